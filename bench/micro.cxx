@@ -0,0 +1,312 @@
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <new>
+#include <vector>
+
+#include <boost/program_options.hpp>
+
+#include "bluepairy.hxx"
+#include "flight.hxx"
+#include "standin.hxx"
+
+// Time and operator new calls per message (or per device) for the code
+// which runs on every signal.  Allocations made by libdbus itself are not
+// counted.
+
+namespace {
+  std::size_t Allocations = 0;
+}
+
+namespace {
+  void *allocate(std::size_t Size) {
+    ++Allocations;
+    if (auto Memory = std::malloc(Size? Size : 1)) return Memory;
+    throw std::bad_alloc();
+  }
+}
+
+void *operator new(std::size_t Size)
+{
+  return allocate(Size);
+}
+
+void *operator new[](std::size_t Size)
+{
+  return allocate(Size);
+}
+
+void operator delete(void *Memory) noexcept
+{
+  std::free(Memory);
+}
+
+void operator delete[](void *Memory) noexcept
+{
+  std::free(Memory);
+}
+
+void operator delete(void *Memory, std::size_t) noexcept
+{
+  std::free(Memory);
+}
+
+void operator delete[](void *Memory, std::size_t) noexcept
+{
+  std::free(Memory);
+}
+
+namespace {
+  using steady_clock = std::chrono::steady_clock;
+  char const * const HID = "00001124-0000-1000-8000-00805f9b34fb";
+
+  std::chrono::nanoseconds MinTime = std::chrono::milliseconds(200);
+
+  // Keeps results alive so that the work is not optimised away.
+  volatile std::size_t Sink;
+
+  // Recording has to be cheap enough to stay on for every signal.
+  constexpr double MaxRecordingTime = 10;
+  bool Failed = false;
+
+  // Runs Round until MinTime has passed; Round returns its operation count.
+  // Returns nanoseconds per operation.
+  template<typename Function>
+  double measure(unsigned Devices, char const *Name, Function const &Round) {
+    std::size_t Operations = 0;
+    auto const AllocationsBefore = Allocations;
+    auto const Start = steady_clock::now();
+    auto Elapsed = steady_clock::duration::zero();
+
+    do {
+      Operations += Round();
+      Elapsed = steady_clock::now() - Start;
+    } while (Elapsed < MinTime);
+
+    auto const Nanoseconds = std::chrono::duration<double, std::nano>(Elapsed);
+    std::cout << std::setw(7) << Devices << "  " << std::left << std::setw(40)
+              << Name << std::right << std::fixed << std::setprecision(1)
+              << std::setw(12) << Nanoseconds.count() / Operations
+              << std::setw(12) << std::setprecision(2)
+              << double(Allocations - AllocationsBefore) / Operations
+              << std::endl;
+
+    return Nanoseconds.count() / Operations;
+  }
+
+  // The a{sv} of the first interface in an InterfacesAdded signal.
+  DBusMessageIter addedProperties(DBusMessage *Signal) {
+    DBusMessageIter Args, Interfaces, Interface, Properties;
+
+    dbus_message_iter_init(Signal, &Args);
+    dbus_message_iter_next(&Args);
+    dbus_message_iter_recurse(&Args, &Interfaces);
+    dbus_message_iter_recurse(&Interfaces, &Interface);
+    dbus_message_iter_next(&Interface);
+    dbus_message_iter_recurse(&Interface, &Properties);
+
+    return Properties;
+  }
+
+  // The a{sv} of a PropertiesChanged signal.
+  DBusMessageIter changedProperties(DBusMessage *Signal) {
+    DBusMessageIter Args, Properties;
+
+    dbus_message_iter_init(Signal, &Args);
+    dbus_message_iter_next(&Args);
+    dbus_message_iter_recurse(&Args, &Properties);
+
+    return Properties;
+  }
+
+  void run(unsigned Devices) {
+    StandIn::Population Objects;
+    Objects.Devices = Devices;
+
+    auto Call = dbus_message_new_method_call
+      ("org.bluez", "/", "org.freedesktop.DBus.ObjectManager",
+       "GetManagedObjects");
+    dbus_message_set_serial(Call, 1);
+    auto ManagedObjects = StandIn::managedObjects(Call, Objects);
+    dbus_message_unref(Call);
+
+    std::vector<DBusMessage *> Added, RSSI, Connected;
+    for (unsigned I = 0; I < Devices; ++I) {
+      Added.push_back(StandIn::interfacesAdded(Objects, I));
+      RSSI.push_back(StandIn::rssiChanged(I, -60));
+      for (bool Value: { true, false }) {
+        Connected.push_back(StandIn::propertyChanged
+          (StandIn::devicePath(I), BlueZ::Device::Interface, "Connected",
+           Value));
+      }
+    }
+    auto Powered = StandIn::propertyChanged
+      (StandIn::adapterPath(), BlueZ::Adapter::Interface, "Powered", true);
+
+    measure(Devices, "GetManagedObjects (per object)", [&] {
+      Bluepairy Pairy("Active Star", { HID }, Bluepairy::Detached{});
+      Pairy.replay(ManagedObjects);
+      return Devices + 2;
+    });
+
+    measure(Devices, "GetManagedObjects, all match (per object)", [&] {
+      Bluepairy Pairy(".", { HID }, Bluepairy::Detached{});
+      Pairy.replay(ManagedObjects);
+      return Devices + 2;
+    });
+
+    {
+      auto WithServices = Objects;
+      WithServices.ServicesPerDevice = 5;
+      auto Call = dbus_message_new_method_call
+        ("org.bluez", "/", "org.freedesktop.DBus.ObjectManager",
+         "GetManagedObjects");
+      dbus_message_set_serial(Call, 1);
+      auto ManagedObjects = StandIn::managedObjects(Call, WithServices);
+      dbus_message_unref(Call);
+
+      measure(Devices, "GetManagedObjects, GATT (per object)", [&] {
+        Bluepairy Pairy("Active Star", { HID }, Bluepairy::Detached{});
+        Pairy.replay(ManagedObjects);
+        return Devices * (1 + WithServices.ServicesPerDevice) + 2;
+      });
+      dbus_message_unref(ManagedObjects);
+    }
+
+    Bluepairy Pairy("Active Star", { HID }, Bluepairy::Detached{});
+    Pairy.replay(ManagedObjects);
+
+    measure(Devices, "InterfacesAdded, full properties", [&] {
+      for (auto Message: Added) Pairy.replay(Message);
+      return Added.size();
+    });
+    measure(Devices, "PropertiesChanged, RSSI only", [&] {
+      for (auto Message: RSSI) Pairy.replay(Message);
+      return RSSI.size();
+    });
+
+    Bluepairy Publishing("Active Star", { HID }, Bluepairy::Detached{});
+    Publishing.replay(ManagedObjects);
+    Publishing.publishSnapshots();
+    measure(Devices, "PropertiesChanged, RSSI, publishing", [&] {
+      for (auto Message: RSSI) Publishing.replay(Message);
+      return RSSI.size();
+    });
+    measure(Devices, "PropertiesChanged, Connected, publishing", [&] {
+      for (auto Message: Connected) Publishing.replay(Message);
+      return Connected.size();
+    });
+    Pairy.publishSnapshots();
+
+    auto const &Known = Pairy.devices();
+    measure(Devices, "Device::onPropertiesChanged, full", [&] {
+      for (std::size_t I = 0; I < Known.size(); ++I) {
+        auto Properties = addedProperties(Added[I]);
+        Known[I]->onPropertiesChanged(Properties);
+      }
+      return Known.size();
+    });
+    measure(Devices, "Device::onPropertiesChanged, RSSI", [&] {
+      for (std::size_t I = 0; I < Known.size(); ++I) {
+        auto Properties = changedProperties(RSSI[I]);
+        Known[I]->onPropertiesChanged(Properties);
+      }
+      return Known.size();
+    });
+    measure(Devices, "Adapter::onPropertiesChanged", [&] {
+      for (int I = 0; I < 1000; ++I) {
+        auto Properties = changedProperties(Powered);
+        Pairy.adapters().front()->onPropertiesChanged(Properties);
+      }
+      return 1000;
+    });
+    measure(Devices, "findDevice", [&] {
+      for (unsigned I = 0; I < Devices; ++I) {
+        Sink = bool(Pairy.findDevice(dbus_message_get_path(RSSI[I])));
+      }
+      return Devices;
+    });
+    measure(Devices, "nameMatches (per device)", [&] {
+      std::size_t Matches = 0;
+      for (auto const &Device: Known) Matches += Pairy.nameMatches(Device);
+      Sink = Matches;
+      return Known.size();
+    });
+    measure(Devices, "hasExpectedProfiles (per device)", [&] {
+      std::size_t Matches = 0;
+      for (auto const &Device: Known) Matches += Pairy.hasExpectedProfiles(Device);
+      Sink = Matches;
+      return Known.size();
+    });
+    measure(Devices, "usableDevices (per device)", [&] {
+      Sink = Pairy.usableDevices().size();
+      return Known.size();
+    });
+    measure(Devices, "Bluepairy::snapshot", [&] {
+      for (int I = 0; I < 1000; ++I) Sink = Pairy.snapshot()->Chunks.size();
+      return 1000;
+    });
+    auto const Received = steady_clock::now();
+    auto const Recording = measure(Devices, "Flight::Recorder::record", [&] {
+      for (int I = 0; I < 1000; ++I) {
+        Pairy.flightRecorder().record(Flight::Producer::Main,
+                                      Flight::Kind::DeviceChanged, Received,
+                                      Known.front()->row(), nullptr, nullptr,
+                                      I);
+      }
+      return 1000;
+    });
+    if (Recording > MaxRecordingTime) {
+      std::cout << "Recording an event takes more than "
+                << MaxRecordingTime << "ns" << std::endl;
+      Failed = true;
+    }
+
+    dbus_message_unref(Powered);
+    for (auto Message: RSSI) dbus_message_unref(Message);
+    for (auto Message: Connected) dbus_message_unref(Message);
+    for (auto Message: Added) dbus_message_unref(Message);
+    dbus_message_unref(ManagedObjects);
+  }
+} // namespace
+
+int main(int argc, char *argv[])
+{
+  std::vector<unsigned> Devices;
+  unsigned Milliseconds = 200;
+
+  namespace po = boost::program_options;
+  po::options_description Desc("Allowed options");
+  Desc.add_options()
+  ("help,?", "print usage message")
+  ("devices", po::value(&Devices)->multitoken(),
+   "Model sizes to measure (default: 10 100 1000 10000)")
+  ("min-time", po::value(&Milliseconds)->default_value(200),
+   "Minimum duration of every measurement in milliseconds")
+  ;
+
+  po::variables_map VariablesMap;
+  try {
+    store(po::parse_command_line(argc, argv, Desc), VariablesMap);
+    notify(VariablesMap);
+  } catch (po::error &E) {
+    std::cerr << E.what() << std::endl << std::endl << Desc << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  if (VariablesMap.count("help") > 0) {
+    std::cout << Desc << std::endl;
+    return EXIT_SUCCESS;
+  }
+
+  if (Devices.empty()) Devices = { 10, 100, 1000, 10000 };
+  MinTime = std::chrono::milliseconds(Milliseconds);
+
+  std::cout << "devices  " << std::left << std::setw(40) << "path"
+            << std::right << std::setw(12) << "ns/op"
+            << std::setw(12) << "allocs/op" << std::endl;
+  for (auto Count: Devices) run(Count);
+
+  return Failed? EXIT_FAILURE : EXIT_SUCCESS;
+}
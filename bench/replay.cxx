@@ -0,0 +1,232 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <deque>
+#include <iomanip>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include <boost/program_options.hpp>
+
+#include "bluepairy.hxx"
+#include "trace.hxx"
+
+// Feeds a trace recorded with "bluepairy --record" through a detached
+// Bluepairy.  Prints every change of the pairing decisions, which is
+// deterministic for a given trace, followed by decode throughput and the
+// latency from handing over a message until the decisions are known.
+// The first run also drives a Pairing in recorded time and prints its
+// transitions.  Its calls are not sent, they complete with the replies
+// recorded for the same calls.
+
+namespace {
+  using nanoseconds = std::chrono::nanoseconds;
+  using steady_clock = std::chrono::steady_clock;
+
+  std::vector<std::string> pathsOf(std::vector<std::shared_ptr<BlueZ::Device>>
+                                   const &Devices) {
+    std::vector<std::string> Paths;
+
+    for (auto const &Device: Devices) Paths.push_back(Device->path());
+    std::sort(Paths.begin(), Paths.end());
+
+    return Paths;
+  }
+
+  void print(std::ostream &Out, nanoseconds Time, char const *What,
+             std::vector<std::shared_ptr<BlueZ::Device>> const &Devices) {
+    Out << '[' << std::fixed << std::setprecision(3) << std::setw(9)
+        << std::chrono::duration<double>(Time).count() << "s] " << What << ':';
+    for (auto const &Device: Devices) {
+      Out << ' ' << Device->name() << " (" << Device->address() << ')';
+    }
+    Out << std::endl;
+  }
+
+  char const *nameOf(Pairing::State State) {
+    switch (State) {
+    case Pairing::State::PoweringUp: return "PoweringUp";
+    case Pairing::State::Searching: return "Searching";
+    case Pairing::State::Pairing: return "Pairing";
+    case Pairing::State::Resolving: return "Resolving";
+    case Pairing::State::Trusting: return "Trusting";
+    case Pairing::State::Connecting: return "Connecting";
+    case Pairing::State::Done: return "Done";
+    case Pairing::State::Failed: break;
+    }
+
+    return "Failed";
+  }
+
+  double us(nanoseconds Duration) {
+    return std::chrono::duration<double, std::micro>(Duration).count();
+  }
+} // namespace
+
+int main(int argc, char *argv[])
+{
+  std::string TraceFile, FriendlyName;
+  std::vector<std::string> UUIDs;
+  unsigned Repeat = 1, Timeout = 300;
+
+  namespace po = boost::program_options;
+  po::options_description Desc("Allowed options");
+  Desc.add_options()
+  ("help,?", "print usage message")
+  ("trace", po::value(&TraceFile)->required(), "Trace to replay")
+  ("friendly-name,n", po::value(&FriendlyName)->required(),
+   "Device name (regex)")
+  ("connect,c", po::value(&UUIDs), "UUID (regex)")
+  ("hid", "Connect to Human Interface Device Service")
+  ("real-time", "Keep the recorded timing instead of going as fast as possible")
+  ("repeat", po::value(&Repeat)->default_value(1),
+   "Replay this often into fresh models and report the total")
+  ("timeout", po::value(&Timeout)->default_value(300),
+   "Seconds the replayed Pairing may take")
+  ("no-pairing", "Only replay the model, without a Pairing")
+  ;
+  po::positional_options_description PositionalDesc;
+  PositionalDesc.add("trace", 1);
+
+  po::variables_map VariablesMap;
+  try {
+    store(po::command_line_parser(argc, argv)
+          .options(Desc)
+          .positional(PositionalDesc)
+          .run(), VariablesMap);
+    if (VariablesMap.count("help") > 0) {
+      std::cout << Desc << std::endl;
+      return EXIT_SUCCESS;
+    }
+    notify(VariablesMap);
+  } catch (po::error &E) {
+    std::cerr << E.what() << std::endl << std::endl << Desc << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  if (VariablesMap.count("hid") > 0) {
+    UUIDs.push_back("00001124-0000-1000-8000-00805f9b34fb");
+  }
+  bool const RealTime = VariablesMap.count("real-time") > 0;
+  bool const Drive = VariablesMap.count("no-pairing") == 0;
+
+  std::deque<Trace::Record> Records;
+  std::size_t Received = 0, Sent = 0, Bytes = 0;
+  try {
+    Trace::Reader Reader(TraceFile);
+
+    Records.emplace_back();
+    while (Reader.next(Records.back())) {
+      if (Records.back().What == Trace::Direction::Received) {
+        Received += 1;
+        Bytes += Records.back().Size;
+      } else {
+        Sent += 1;
+      }
+      Records.emplace_back();
+    }
+    Records.pop_back();
+  } catch (std::exception &E) {
+    std::cerr << E.what() << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  std::vector<nanoseconds> Latencies;
+  Latencies.reserve(Received * Repeat);
+  nanoseconds Busy{};
+
+  for (unsigned Run = 0; Run < Repeat; ++Run) {
+    // Logging agent requests once is enough.
+    if (Run == 1) std::clog.setstate(std::ios::badbit);
+
+    Bluepairy Pairy(FriendlyName, UUIDs, Bluepairy::Detached{});
+    std::vector<std::string> Pairable, Usable;
+    auto const Start = steady_clock::now();
+    nanoseconds Now{};
+
+    // Its timeouts and backoff only make sense in recorded time.
+    std::unique_ptr<Pairing> Machine;
+    if (Run == 0 && Drive) {
+      Machine.reset(new Pairing(Pairy, std::chrono::seconds(Timeout),
+                                &std::cout));
+      Machine->onTransition([&Now](Pairing::State State) {
+        std::cout << '[' << std::fixed << std::setprecision(3) << std::setw(9)
+                  << std::chrono::duration<double>(Now).count()
+                  << "s] pairing: " << nameOf(State) << std::endl;
+      });
+    }
+
+    for (auto const &Record: Records) {
+      if (RealTime || Machine) {
+        std::this_thread::sleep_until(Start + Record.Time);
+      }
+      Now = Record.Time;
+
+      if (Record.What != Trace::Direction::Received) {
+        Pairy.expect(Record.Message);
+        continue;
+      }
+
+      auto const Before = steady_clock::now();
+      try {
+        Pairy.replay(Record.Message);
+      } catch (std::exception &E) {
+        if (Run == 0) std::cout << "Error: " << E.what() << std::endl;
+      }
+      auto const PairableDevices = Pairy.pairableDevices();
+      auto const UsableDevices = Pairy.usableDevices();
+      auto const Latency = steady_clock::now() - Before;
+
+      Latencies.push_back(std::chrono::duration_cast<nanoseconds>(Latency));
+      Busy += Latency;
+
+      // Only once the recorded GetManagedObjects reply set up the model,
+      // like bluepairy does.
+      if (Machine) Machine->advance();
+
+      if (Run == 0) {
+        auto Paths = pathsOf(PairableDevices);
+        if (Paths != Pairable) {
+          print(std::cout, Record.Time, "pairable", PairableDevices);
+          Pairable = std::move(Paths);
+        }
+        Paths = pathsOf(UsableDevices);
+        if (Paths != Usable) {
+          print(std::cout, Record.Time, "usable", UsableDevices);
+          Usable = std::move(Paths);
+        }
+      }
+    }
+
+    if (Machine && !Machine->finished()) {
+      std::cout << "Pairing still " << nameOf(Machine->state())
+                << " at the end of the trace" << std::endl;
+    } else if (Machine && !Machine->error().empty()) {
+      std::cout << "Pairing failed: " << Machine->error() << std::endl;
+    }
+  }
+
+  std::cout << Received << " received and " << Sent << " sent messages ("
+            << Bytes << " bytes received), " << Repeat << " runs"
+            << std::endl;
+  if (Latencies.empty()) return EXIT_SUCCESS;
+
+  auto const Seconds = std::chrono::duration<double>(Busy).count();
+  std::cout << "throughput: " << std::setprecision(0)
+            << Latencies.size() / Seconds << " messages/s, "
+            << std::setprecision(2)
+            << Bytes * double(Repeat) / Seconds / (1024 * 1024) << " MiB/s"
+            << std::endl;
+
+  std::sort(Latencies.begin(), Latencies.end());
+  auto percentile = [&Latencies](double P) {
+    return Latencies[std::min(Latencies.size() - 1,
+                              std::size_t(P * Latencies.size()))];
+  };
+  std::cout << "decision latency: median " << std::setprecision(1)
+            << us(percentile(0.5)) << "us, p99 " << us(percentile(0.99))
+            << "us, max " << us(Latencies.back()) << "us" << std::endl;
+
+  return EXIT_SUCCESS;
+}
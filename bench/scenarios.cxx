@@ -0,0 +1,702 @@
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/program_options.hpp>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "bluepairy.h"
+#include "bluepairy.hxx"
+#include "standin.hxx"
+
+// Runs bluepairy against a stand-in BlueZ in situations which real
+// hardware only produces by chance, and checks the outcome.  Every
+// scenario runs in a child process with a bus and a stand-in of its own,
+// since libdbus looks up the system bus address only once per process.
+// Exits with failure if any scenario fails.
+
+namespace {
+  using std::chrono::milliseconds;
+  using std::chrono::seconds;
+  using steady_clock = std::chrono::steady_clock;
+
+  char const * const HID = "00001124-0000-1000-8000-00805f9b34fb";
+
+  // Bluepairy finds it as the system bus.
+  struct Setup {
+    StandIn::Daemon Daemon;
+    StandIn::Service BlueZ;
+
+    explicit Setup(StandIn::Population const &Objects)
+    : BlueZ(Daemon.address(), Objects) {
+      setenv("DBUS_SYSTEM_BUS_ADDRESS", Daemon.address().c_str(), 1);
+    }
+  };
+
+  void expect(bool Condition, std::string const &What) {
+    if (!Condition) throw std::runtime_error(What);
+  }
+
+  void pump(Bluepairy &Pairy, steady_clock::duration Duration) {
+    auto const End = steady_clock::now() + Duration;
+
+    while (steady_clock::now() < End) Pairy.readWrite();
+  }
+
+  // Like bluepairy does once it is set up.
+  void drive(Bluepairy &Pairy, Pairing &Machine) {
+    for (Machine.advance(); !Machine.finished(); Machine.advance()) {
+      Pairy.readWrite();
+    }
+  }
+
+  // Reads the state socket without blocking.
+  class StateClient {
+    int FD;
+
+  public:
+    std::string Text;
+
+    explicit StateClient(std::string const &Path) {
+      sockaddr_un Address{};
+      Address.sun_family = AF_UNIX;
+      Path.copy(Address.sun_path, sizeof(Address.sun_path) - 1);
+
+      FD = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+      if (FD == -1 ||
+          connect(FD, reinterpret_cast<sockaddr *>(&Address),
+                  sizeof(Address)) == -1) {
+        if (FD != -1) close(FD);
+        throw std::runtime_error("Failed to connect to " + Path);
+      }
+    }
+    StateClient(StateClient const &) = delete;
+    StateClient &operator=(StateClient const &) = delete;
+    ~StateClient() { close(FD); }
+
+    // False once bluepairy closed the connection.
+    bool read() {
+      char Buffer[4096];
+      ssize_t Count;
+
+      while ((Count = recv(FD, Buffer, sizeof(Buffer), 0)) > 0) {
+        Text.append(Buffer, Count);
+      }
+
+      return Count == -1 && errno == EAGAIN;
+    }
+
+    std::size_t batches() const {
+      std::size_t Count = Text.compare(0, 2, ".\n") == 0? 1 : 0;
+
+      for (auto Pos = Text.find("\n.\n"); Pos != std::string::npos;
+           Pos = Text.find("\n.\n", Pos + 1)) {
+        Count += 1;
+      }
+
+      return Count;
+    }
+  };
+
+  void expectDone(Pairing const &Machine) {
+    expect(Machine.state() == Pairing::State::Done,
+           "Pairing failed: " + Machine.error());
+  }
+
+  // Only the target shows up during discovery, the stale pairings have
+  // last been seen when the model was loaded.
+  std::vector<std::shared_ptr<BlueZ::Device>>
+  discoverStale(Bluepairy &Pairy) {
+    pump(Pairy, milliseconds(300));
+    Pairy.startDiscovery();
+    pump(Pairy, milliseconds(50));
+
+    return Pairy.stalePairings(milliseconds(200));
+  }
+
+  void staleOutOfRange() {
+    StandIn::Population Objects;
+    Objects.Devices = 4;
+    Objects.TargetPaired = true;
+    Objects.StalePairings = 2;
+    Setup Bus(Objects);
+    Bluepairy Pairy("Active Star", {HID});
+
+    auto const Stale = discoverStale(Pairy);
+    expect(Stale.size() == 2, std::to_string(Stale.size()) +
+           " stale pairings instead of 2");
+    for (auto const &Device: Stale) {
+      expect(Device->address() != StandIn::deviceAddress(0),
+             "The target is considered stale");
+    }
+    expect(Pairy.forget(Stale, seconds(5)) == 2, "Stale pairings remain");
+  }
+
+  void staleKeepsLast() {
+    StandIn::Population Objects;
+    Objects.Devices = 3;
+    Objects.StalePairings = 1;
+    Setup Bus(Objects);
+    Bluepairy Pairy("Active Star", {HID});
+
+    expect(discoverStale(Pairy).empty(),
+           "The only pairing is considered stale");
+  }
+
+  void staleRemovalRefused() {
+    StandIn::Population Objects;
+    Objects.Devices = 2;
+    Objects.TargetPaired = true;
+    Objects.StalePairings = 1;
+    Objects.RemoveError = "org.bluez.Error.Failed";
+    Setup Bus(Objects);
+    Bluepairy Pairy("Active Star", {HID});
+
+    auto const Stale = discoverStale(Pairy);
+    expect(Stale.size() == 1, "No stale pairing found");
+
+    auto const Start = steady_clock::now();
+    expect(Pairy.forget(Stale, seconds(5)) == 0, "Refused removal succeeded");
+    expect(steady_clock::now() - Start < seconds(1),
+           "Kept waiting for a refused removal");
+  }
+
+  // BlueZ has no object for the target yet, ConnectDevice creates it.
+  void addressFastPath() {
+    StandIn::Population Objects;
+    Objects.Devices = 3;
+    Objects.TargetKnown = false;
+    Setup Bus(Objects);
+    Bluepairy Pairy("Active Star", {HID});
+    Pairy.targetAddress(StandIn::deviceAddress(0));
+    Pairing Machine(Pairy, seconds(10), &std::clog);
+
+    drive(Pairy, Machine);
+    expectDone(Machine);
+    expect(!Pairy.isDiscovering(), "Discovered a known address");
+  }
+
+  // Matched by manufacturer data before the name is known.  The PIN is
+  // derived from the name, which arrives while BlueZ asks for it.
+  void hintMatch() {
+    StandIn::Population Objects;
+    Objects.Devices = 3;
+    Objects.TargetNamed = false;
+    Objects.PIN = "24680";
+    Setup Bus(Objects);
+    Bluepairy Pairy("Active Star", {HID});
+    Bluepairy::Hints Hints;
+    Hints.Manufacturers.push_back({0x0a7b, {0x01, 0x02}});
+    Pairy.targetHints(Hints);
+    Pairing Machine(Pairy, seconds(10), &std::clog);
+
+    drive(Pairy, Machine);
+    expectDone(Machine);
+    for (auto const &Entry: Machine.attempts()) {
+      expect(Entry.second.Failures == 0, "Pairing failed with " +
+             Entry.second.LastError);
+    }
+  }
+
+  // Radio trouble is retried after 0.5-1s, then 1-2s.
+  void pairBackoff() {
+    StandIn::Population Objects;
+    Objects.PairFailures = 2;
+    Setup Bus(Objects);
+    Bluepairy Pairy("Active Star", {HID});
+    Pairing Machine(Pairy, seconds(10), &std::clog);
+
+    auto const Start = steady_clock::now();
+    drive(Pairy, Machine);
+    auto const Elapsed = steady_clock::now() - Start;
+    expectDone(Machine);
+
+    auto const &Attempt = Machine.attempts().at(StandIn::deviceAddress(0));
+    expect(Attempt.Count == 3 && Attempt.Failures == 2,
+           std::to_string(Attempt.Count) + " attempts, " +
+           std::to_string(Attempt.Failures) + " failed");
+    expect(Elapsed >= milliseconds(1500), "Retried without backing off");
+    expect(Elapsed < seconds(4), "Backed off too long");
+  }
+
+  // A wrong PIN is not retried soon.
+  void authenticationQuarantine() {
+    StandIn::Population Objects;
+    Objects.PairFailures = 1;
+    Objects.PairError = "org.bluez.Error.AuthenticationFailed";
+    Setup Bus(Objects);
+    Bluepairy Pairy("Active Star", {HID});
+    Pairing Machine(Pairy, seconds(3), &std::clog);
+
+    drive(Pairy, Machine);
+    expect(Machine.state() == Pairing::State::Failed,
+           "Paired although authentication failed");
+
+    auto const &Attempt = Machine.attempts().at(StandIn::deviceAddress(0));
+    expect(Attempt.Count == 1, "Retried after authentication failed");
+  }
+
+  // BR/EDR devices only list their profiles once paired.
+  StandIn::Population pairFirstPopulation() {
+    StandIn::Population Objects;
+    Objects.Devices = 3;
+    Objects.ProfilesAfterPairing = true;
+
+    return Objects;
+  }
+
+  void pairFirstMatch() {
+    Setup Bus(pairFirstPopulation());
+    Bluepairy Pairy("Active Star", {HID});
+    Pairy.pairFirst(true);
+    Pairing Machine(Pairy, seconds(10), &std::clog);
+
+    drive(Pairy, Machine);
+    expectDone(Machine);
+  }
+
+  // Unpaired and never tried again.
+  void pairFirstMismatch() {
+    auto Objects = pairFirstPopulation();
+    Objects.TargetHID = false;
+    Setup Bus(Objects);
+    Bluepairy Pairy("Active Star", {HID});
+    Pairy.pairFirst(true);
+    Pairing Machine(Pairy, seconds(3), &std::clog);
+
+    drive(Pairy, Machine);
+    expect(Machine.state() == Pairing::State::Failed,
+           "Connected without the expected profiles");
+
+    auto const &Attempt = Machine.attempts().at(StandIn::deviceAddress(0));
+    expect(Attempt.Count == 1, "Paired again after a mismatch");
+    expect(Attempt.NotBefore == steady_clock::time_point::max(),
+           "Mismatch not permanent: " + Attempt.LastError);
+    auto const Device = Pairy.findDevice(StandIn::devicePath(0).c_str());
+    expect(!Device || !Device->isPaired(), "Mismatch not unpaired");
+  }
+
+  // Without ServicesResolved the profiles are unknown, not missing.
+  void pairFirstUnresolved() {
+    auto Objects = pairFirstPopulation();
+    Objects.TargetResolves = false;
+    Setup Bus(Objects);
+    Bluepairy Pairy("Active Star", {HID});
+    Pairy.pairFirst(true);
+    Pairing Machine(Pairy, seconds(12), &std::clog);
+
+    drive(Pairy, Machine);
+    auto const &Attempt = Machine.attempts().at(StandIn::deviceAddress(0));
+    expect(Attempt.Failures == 1 &&
+           Attempt.LastError == "Services not resolved",
+           "Unexpected outcome: " + Attempt.LastError);
+    expect(Attempt.NotBefore < steady_clock::now() + seconds(2),
+           "Not retried soon");
+  }
+
+  // Discovery floods the I/O thread with more signals than its queue
+  // holds, and it answers the PIN request once the name arrives.
+  void threaded() {
+    StandIn::Population Objects;
+    Objects.Devices = 600;
+    Objects.TargetNamed = false;
+    Objects.PIN = "24680";
+    Setup Bus(Objects);
+    Bluepairy Pairy("Active Star", {HID});
+    Bluepairy::Hints Hints;
+    Hints.Manufacturers.push_back({0x0a7b, {0x01, 0x02}});
+    Pairy.targetHints(Hints);
+    Pairy.startIOThread();
+    expect(Pairy.isThreaded(), "No I/O thread");
+
+    Pairy.startDiscovery();
+    Pairing Machine(Pairy, seconds(10), &std::clog);
+    drive(Pairy, Machine);
+    expectDone(Machine);
+
+    auto const Stats = Pairy.eventStats();
+    expect(Stats.Events >= Objects.Devices, "Only " +
+           std::to_string(Stats.Events) + " events were handed over");
+    expect(Stats.MaxQueueDepth > 0, "Queue depth not tracked");
+  }
+
+  // Clients get all objects, then changes.  One which does not read is
+  // dropped, the other keeps getting batches.
+  void stateSocket() {
+    StandIn::Population Objects;
+    Objects.Devices = 300;
+    Setup Bus(Objects);
+    Bluepairy Pairy("Active Star", {HID});
+    auto const Path = "/tmp/bluepairy-scenario-" + std::to_string(getpid());
+    Pairy.serveState(Path);
+    StateClient Reader(Path), Silent(Path);
+
+    auto await = [&Pairy, &Reader](std::size_t Batches) {
+      auto const End = steady_clock::now() + seconds(5);
+
+      while (Reader.batches() < Batches && steady_clock::now() < End) {
+        Pairy.readWrite();
+        expect(Reader.read(), "Reading client was dropped");
+      }
+      expect(Reader.batches() >= Batches,
+             "Batch " + std::to_string(Batches) + " did not arrive");
+    };
+
+    await(1);
+    expect(Reader.Text.compare(0, 8 + StandIn::adapterPath().size(),
+                               "adapter " + StandIn::adapterPath()) == 0,
+           "Snapshot does not start with the adapter");
+    expect(Reader.Text.find("device " + StandIn::devicePath(0) + " ") !=
+           std::string::npos, "Target missing from the snapshot");
+    auto const SnapshotSize = Reader.Text.size();
+
+    // The RSSI is not part of the state, so only the adapter changes.
+    Pairy.startDiscovery();
+    await(2);
+    pump(Pairy, milliseconds(200));
+    expect(Reader.read(), "Reading client was dropped");
+    expect(Reader.batches() == 2, "RSSI changes were sent");
+    expect(Reader.Text.find("adapter ", SnapshotSize) != std::string::npos,
+           "Discovery not sent");
+    expect(Reader.Text.find("device ", SnapshotSize) == std::string::npos,
+           "Devices sent for RSSI changes");
+
+    // Every device is listed again whenever the adapter is powered.
+    for (std::size_t Batch = 3; Batch < 15; ++Batch) {
+      Pairy.adapters().front()->power(true);
+      await(Batch);
+    }
+
+    auto const End = steady_clock::now() + seconds(5);
+    while (Silent.read()) {
+      expect(steady_clock::now() < End, "Silent client was not dropped");
+      pump(Pairy, milliseconds(10));
+    }
+    expect(Silent.batches() < Reader.batches(),
+           "Silent client got everything");
+  }
+
+  // Like a C program with a main loop of its own.
+  using Handle = std::unique_ptr<bluepairy, decltype(&bluepairy_free)>;
+
+  std::shared_ptr<DBusConnection> openSystemBus() {
+    DBusError Error;
+    dbus_error_init(&Error);
+    auto const Connection = dbus_bus_get_private(DBUS_BUS_SYSTEM, &Error);
+    dbus_error_free(&Error);
+    expect(Connection != nullptr, "No connection to the system bus");
+
+    return { Connection, [](DBusConnection *Connection) {
+      dbus_connection_close(Connection);
+      dbus_connection_unref(Connection);
+    }};
+  }
+
+  bluepairy_state driveC(bluepairy *Pairy, DBusConnection *Connection,
+                         std::vector<bluepairy_state> &States) {
+    auto const OnState = [](bluepairy *, bluepairy_state State, void *Data) {
+      static_cast<std::vector<bluepairy_state> *>(Data)->push_back(State);
+    };
+    expect(bluepairy_start(Pairy, 10, OnState, &States) == 0,
+           "Failed to start");
+    expect(bluepairy_start(Pairy, 10, OnState, &States) == -1,
+           "Started twice");
+
+    auto State = bluepairy_process(Pairy);
+    auto const End = steady_clock::now() + seconds(15);
+    while (State != BLUEPAIRY_DONE && State != BLUEPAIRY_FAILED &&
+           steady_clock::now() < End) {
+      dbus_connection_read_write_dispatch(Connection, 10);
+      State = bluepairy_process(Pairy);
+    }
+
+    return State;
+  }
+
+  void cAPI() {
+    StandIn::Population Objects;
+    Objects.Devices = 3;
+    Setup Bus(Objects);
+    auto const Connection = openSystemBus();
+    char const *UUIDs[] = { HID, nullptr };
+    char *Error = nullptr;
+    Handle Pairy(bluepairy_new(Connection.get(), "Active Star", UUIDs, &Error),
+                 bluepairy_free);
+    expect(Pairy != nullptr, Error? Error : "bluepairy_new failed");
+    expect(bluepairy_set_address(Pairy.get(), "00:07:80") == -1,
+           "Malformed address accepted");
+
+    std::vector<bluepairy_state> States;
+    auto const State = driveC(Pairy.get(), Connection.get(), States);
+    expect(State == BLUEPAIRY_DONE, bluepairy_get_error(Pairy.get())
+                                    ? bluepairy_get_error(Pairy.get())
+                                    : "Pairing did not finish");
+    expect(bluepairy_get_state(Pairy.get()) == BLUEPAIRY_DONE,
+           "State differs from what bluepairy_process returned");
+    expect(!States.empty() && States.back() == BLUEPAIRY_DONE,
+           "Callback missed the end");
+
+    char const *Name, *Address;
+    expect(bluepairy_get_usable_count(Pairy.get()) == 1,
+           "Not exactly one usable device");
+    expect(bluepairy_get_usable(Pairy.get(), 0, &Name, &Address) == 0 &&
+           Name == Objects.TargetName &&
+           Address == StandIn::deviceAddress(0), "Wrong usable device");
+    expect(bluepairy_get_usable(Pairy.get(), 1, &Name, &Address) == -1,
+           "Usable device beyond the count");
+  }
+
+  // Without a name pattern, by address only.
+  void cAPIAddress() {
+    StandIn::Population Objects;
+    Objects.Devices = 3;
+    Objects.TargetKnown = false;
+    Setup Bus(Objects);
+    auto const Connection = openSystemBus();
+    char const *UUIDs[] = { HID, nullptr };
+    Handle Pairy(bluepairy_new(Connection.get(), nullptr, UUIDs, nullptr),
+                 bluepairy_free);
+    expect(Pairy != nullptr, "bluepairy_new failed");
+    expect(bluepairy_set_address(Pairy.get(),
+                                 StandIn::deviceAddress(0).c_str()) == 0,
+           "Address refused");
+
+    std::vector<bluepairy_state> States;
+    expect(driveC(Pairy.get(), Connection.get(), States) == BLUEPAIRY_DONE,
+           "Pairing by address failed");
+  }
+
+  // Readers on other threads keep seeing complete snapshots of increasing
+  // generations while discovery and pairing change the model.
+  void snapshotReaders() {
+    StandIn::Population Objects;
+    Objects.Devices = 200;
+    Setup Bus(Objects);
+    Bluepairy Pairy("Active Star", {HID});
+    Pairy.publishSnapshots();
+
+    std::atomic<bool> Stop{false};
+    std::vector<std::string> Errors(8);
+    std::vector<std::thread> Readers;
+    for (auto &Error: Errors) {
+      Readers.emplace_back([&Pairy, &Stop, &Error, &Objects] {
+        std::uint64_t Last = 0;
+
+        while (!Stop.load(std::memory_order_relaxed) && Error.empty()) {
+          auto const Snapshot = Pairy.snapshot();
+          if (!Snapshot) {
+            Error = "Nothing published";
+            break;
+          }
+          if (Snapshot->Generation < Last) Error = "Generation went back";
+          Last = Snapshot->Generation;
+
+          unsigned Devices = 0;
+          Snapshot->forEachDevice([&Devices, &Error](auto const &Device) {
+            Devices += 1;
+            if (Device.Path.empty() || Device.Address.empty()) {
+              Error = "Incomplete device " + Device.Path;
+            }
+            if (Device.Usable && !Device.Paired) {
+              Error = "Usable but not paired: " + Device.Path;
+            }
+          });
+          if (Devices != Objects.Devices) {
+            Error = std::to_string(Devices) + " devices in a snapshot";
+          }
+        }
+      });
+    }
+
+    Pairy.startDiscovery();
+    Pairing Machine(Pairy, seconds(10), &std::clog);
+    drive(Pairy, Machine);
+    Stop = true;
+    for (auto &Reader: Readers) Reader.join();
+    expectDone(Machine);
+    for (auto const &Error: Errors) expect(Error.empty(), Error);
+
+    auto const Snapshot = Pairy.snapshot();
+    bool TargetUsable = false;
+    Snapshot->forEachDevice([&TargetUsable](auto const &Device) {
+      if (Device.Usable) {
+        TargetUsable = Device.Address == StandIn::deviceAddress(0);
+      }
+    });
+    expect(Snapshot->Generation > 1, "Nothing published after the first");
+    expect(TargetUsable, "Target not usable in the last snapshot");
+  }
+
+  void cAPISnapshots() {
+    StandIn::Population Objects;
+    Objects.Devices = 3;
+    Setup Bus(Objects);
+    auto const Connection = openSystemBus();
+    char const *UUIDs[] = { HID, nullptr };
+    Handle Pairy(bluepairy_new(Connection.get(), "Active Star", UUIDs,
+                               nullptr), bluepairy_free);
+    expect(Pairy != nullptr, "bluepairy_new failed");
+    expect(bluepairy_snapshot_read(Pairy.get()) == nullptr,
+           "Snapshot before publishing");
+    expect(bluepairy_publish_snapshots(Pairy.get()) == 0,
+           "Failed to publish");
+
+    std::atomic<bool> Stop{false};
+    std::string Error;
+    std::thread Reader([&Pairy, &Stop, &Error] {
+      while (!Stop.load(std::memory_order_relaxed) && Error.empty()) {
+        auto const Snapshot = bluepairy_snapshot_read(Pairy.get());
+        if (Snapshot == nullptr) {
+          Error = "Nothing published";
+          break;
+        }
+        for (std::size_t Index = 0;
+             Index < bluepairy_snapshot_usable_count(Snapshot); ++Index) {
+          char const *Name, *Address;
+          if (bluepairy_snapshot_get_usable(Snapshot, Index, &Name,
+                                            &Address) != 0 || !*Address) {
+            Error = "Usable device without an address";
+          }
+        }
+        bluepairy_snapshot_release(Snapshot);
+      }
+    });
+
+    std::vector<bluepairy_state> States;
+    auto const State = driveC(Pairy.get(), Connection.get(), States);
+    Stop = true;
+    Reader.join();
+    expect(State == BLUEPAIRY_DONE, "Pairing did not finish");
+    expect(Error.empty(), Error);
+
+    auto const Snapshot = bluepairy_snapshot_read(Pairy.get());
+    char const *Name, *Address;
+    bool const Usable = bluepairy_snapshot_usable_count(Snapshot) == 1 &&
+      bluepairy_snapshot_get_usable(Snapshot, 0, &Name, &Address) == 0 &&
+      Address == StandIn::deviceAddress(0);
+    auto const Generation = bluepairy_snapshot_generation(Snapshot);
+    bluepairy_snapshot_release(Snapshot);
+    expect(Usable, "Target not usable in the last snapshot");
+    expect(Generation > 1, "Nothing published after the first");
+  }
+
+  struct Scenario {
+    char const *Name;
+    void (*Run)();
+  };
+
+  bool run(Scenario const &Scenario, bool Verbose) {
+    std::cout.flush();
+    auto const Pid = fork();
+    if (Pid == -1) {
+      std::cout << "FAIL " << Scenario.Name << ": fork failed" << std::endl;
+      return false;
+    }
+    if (Pid == 0) {
+      if (!Verbose) {
+        std::clog.setstate(std::ios::badbit);
+        auto const Null = open("/dev/null", O_WRONLY);
+        dup2(Null, STDERR_FILENO);
+        close(Null);
+      }
+      try {
+        Scenario.Run();
+        std::cout << "ok   " << Scenario.Name << std::endl;
+      } catch (std::exception &E) {
+        std::cout << "FAIL " << Scenario.Name << ": " << E.what() << std::endl;
+        _exit(EXIT_FAILURE);
+      }
+      _exit(EXIT_SUCCESS);
+    }
+
+    int Status;
+    waitpid(Pid, &Status, 0);
+    if (!WIFEXITED(Status)) {
+      std::cout << "FAIL " << Scenario.Name << ": crashed" << std::endl;
+      return false;
+    }
+
+    return WEXITSTATUS(Status) == EXIT_SUCCESS;
+  }
+
+  Scenario const Scenarios[] = {
+    { "stale-out-of-range", staleOutOfRange },
+    { "stale-keeps-last", staleKeepsLast },
+    { "stale-removal-refused", staleRemovalRefused },
+    { "address-fast-path", addressFastPath },
+    { "hint-match", hintMatch },
+    { "pair-backoff", pairBackoff },
+    { "authentication-quarantine", authenticationQuarantine },
+    { "pair-first-match", pairFirstMatch },
+    { "pair-first-mismatch", pairFirstMismatch },
+    { "pair-first-unresolved", pairFirstUnresolved },
+    { "threaded", threaded },
+    { "state-socket", stateSocket },
+    { "c-api", cAPI },
+    { "c-api-address", cAPIAddress },
+    { "snapshot-readers", snapshotReaders },
+    { "c-api-snapshots", cAPISnapshots },
+  };
+} // namespace
+
+int main(int argc, char *argv[])
+{
+  std::vector<std::string> Names;
+
+  namespace po = boost::program_options;
+  po::options_description Desc("Allowed options");
+  Desc.add_options()
+  ("help,?", "print usage message")
+  ("list", "List scenarios")
+  ("verbose,v", "Show what bluepairy and the stand-in log")
+  ("scenario", po::value(&Names), "Only run these scenarios")
+  ;
+  po::positional_options_description PositionalDesc;
+  PositionalDesc.add("scenario", -1);
+
+  po::variables_map VariablesMap;
+  try {
+    store(po::command_line_parser(argc, argv)
+          .options(Desc)
+          .positional(PositionalDesc)
+          .run(), VariablesMap);
+    if (VariablesMap.count("help") > 0) {
+      std::cout << Desc << std::endl;
+      return EXIT_SUCCESS;
+    }
+    notify(VariablesMap);
+  } catch (po::error &E) {
+    std::cerr << E.what() << std::endl << std::endl << Desc << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  if (VariablesMap.count("list") > 0) {
+    for (auto const &Scenario: Scenarios) std::cout << Scenario.Name << std::endl;
+    return EXIT_SUCCESS;
+  }
+
+  bool const Verbose = VariablesMap.count("verbose") > 0;
+  unsigned Failures = 0;
+  for (auto const &Scenario: Scenarios) {
+    if (!Names.empty() &&
+        find(begin(Names), end(Names), Scenario.Name) == end(Names)) {
+      continue;
+    }
+
+    if (!run(Scenario, Verbose)) Failures += 1;
+  }
+
+  return Failures == 0? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,635 @@
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <new>
+#include <stdexcept>
+#include <system_error>
+
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "standin.hxx"
+
+namespace {
+  char const * const AdapterInterface = "org.bluez.Adapter1";
+  char const * const DeviceInterface = "org.bluez.Device1";
+  char const * const HID = "00001124-0000-1000-8000-00805f9b34fb";
+  char const * const SPP = "00001101-0000-1000-8000-00805f9b34fb";
+  char const * const Battery = "0000180f-0000-1000-8000-00805f9b34fb";
+
+  void check(dbus_bool_t Result) {
+    if (Result == FALSE) throw std::bad_alloc();
+  }
+
+  DBusMessage *check(DBusMessage *Message) {
+    if (Message == nullptr) throw std::bad_alloc();
+    return Message;
+  }
+
+  template<typename T>
+  void appendVariant(DBusMessageIter *Dict, char const *Name,
+                     int Type, char const *Signature, T const &Value) {
+    DBusMessageIter Entry, Variant;
+
+    check(dbus_message_iter_open_container(Dict, DBUS_TYPE_DICT_ENTRY,
+                                           nullptr, &Entry));
+    check(dbus_message_iter_append_basic(&Entry, DBUS_TYPE_STRING, &Name));
+    check(dbus_message_iter_open_container(&Entry, DBUS_TYPE_VARIANT,
+                                           Signature, &Variant));
+    check(dbus_message_iter_append_basic(&Variant, Type, &Value));
+    check(dbus_message_iter_close_container(&Entry, &Variant));
+    check(dbus_message_iter_close_container(Dict, &Entry));
+  }
+
+  void appendString(DBusMessageIter *Dict, char const *Name,
+                    std::string const &Value) {
+    char const *String = Value.c_str();
+    appendVariant(Dict, Name, DBUS_TYPE_STRING, "s", String);
+  }
+
+  void appendPath(DBusMessageIter *Dict, char const *Name,
+                  std::string const &Value) {
+    char const *String = Value.c_str();
+    appendVariant(Dict, Name, DBUS_TYPE_OBJECT_PATH, "o", String);
+  }
+
+  void appendBool(DBusMessageIter *Dict, char const *Name, bool Value) {
+    dbus_bool_t Bool = Value? TRUE : FALSE;
+    appendVariant(Dict, Name, DBUS_TYPE_BOOLEAN, "b", Bool);
+  }
+
+  void appendStrings(DBusMessageIter *Dict, char const *Name,
+                     std::initializer_list<char const *> Values) {
+    DBusMessageIter Entry, Variant, Array;
+
+    check(dbus_message_iter_open_container(Dict, DBUS_TYPE_DICT_ENTRY,
+                                           nullptr, &Entry));
+    check(dbus_message_iter_append_basic(&Entry, DBUS_TYPE_STRING, &Name));
+    check(dbus_message_iter_open_container(&Entry, DBUS_TYPE_VARIANT,
+                                           "as", &Variant));
+    check(dbus_message_iter_open_container(&Variant, DBUS_TYPE_ARRAY,
+                                           "s", &Array));
+    for (auto Value: Values) {
+      check(dbus_message_iter_append_basic(&Array, DBUS_TYPE_STRING, &Value));
+    }
+    check(dbus_message_iter_close_container(&Variant, &Array));
+    check(dbus_message_iter_close_container(&Entry, &Variant));
+    check(dbus_message_iter_close_container(Dict, &Entry));
+  }
+
+  void appendAdapterProperties(DBusMessageIter *Dict) {
+    appendString(Dict, "Address", "B8:27:EB:00:00:01");
+    appendString(Dict, "AddressType", "public");
+    appendString(Dict, "Name", "brlpi");
+    appendString(Dict, "Alias", "brlpi");
+    appendVariant(Dict, "Class", DBUS_TYPE_UINT32, "u", dbus_uint32_t(0));
+    appendBool(Dict, "Powered", true);
+    appendBool(Dict, "Discoverable", false);
+    appendBool(Dict, "Pairable", true);
+    appendBool(Dict, "Discovering", false);
+    appendStrings(Dict, "UUIDs", { SPP, HID });
+  }
+
+  void appendManufacturerData(DBusMessageIter *Dict, dbus_uint16_t Company,
+                              std::initializer_list<unsigned char> Bytes) {
+    DBusMessageIter Entry, Variant, Data, DataEntry, Payload, Array;
+    char const *Name = "ManufacturerData";
+    unsigned char const *Values = Bytes.begin();
+
+    check(dbus_message_iter_open_container(Dict, DBUS_TYPE_DICT_ENTRY,
+                                           nullptr, &Entry));
+    check(dbus_message_iter_append_basic(&Entry, DBUS_TYPE_STRING, &Name));
+    check(dbus_message_iter_open_container(&Entry, DBUS_TYPE_VARIANT,
+                                           "a{qv}", &Variant));
+    check(dbus_message_iter_open_container(&Variant, DBUS_TYPE_ARRAY,
+                                           "{qv}", &Data));
+    check(dbus_message_iter_open_container(&Data, DBUS_TYPE_DICT_ENTRY,
+                                           nullptr, &DataEntry));
+    check(dbus_message_iter_append_basic(&DataEntry, DBUS_TYPE_UINT16,
+                                         &Company));
+    check(dbus_message_iter_open_container(&DataEntry, DBUS_TYPE_VARIANT,
+                                           "ay", &Payload));
+    check(dbus_message_iter_open_container(&Payload, DBUS_TYPE_ARRAY,
+                                           "y", &Array));
+    check(dbus_message_iter_append_fixed_array(&Array, DBUS_TYPE_BYTE, &Values,
+                                               int(Bytes.size())));
+    check(dbus_message_iter_close_container(&Payload, &Array));
+    check(dbus_message_iter_close_container(&DataEntry, &Payload));
+    check(dbus_message_iter_close_container(&Data, &DataEntry));
+    check(dbus_message_iter_close_container(&Variant, &Data));
+    check(dbus_message_iter_close_container(&Entry, &Variant));
+    check(dbus_message_iter_close_container(Dict, &Entry));
+  }
+
+  void appendDeviceProperties(DBusMessageIter *Dict,
+                              StandIn::Population const &Objects,
+                              unsigned Device) {
+    bool const Target = Device == 0;
+    // Earlier displays of the same kind, paired but out of range.
+    bool const Stale = Device > 0 && Device <= Objects.StalePairings;
+    auto const Name = Target? Objects.TargetName
+                    : Stale? Objects.TargetName + std::to_string(Device)
+                    : "Bystander " + std::to_string(Device);
+
+    appendString(Dict, "Address", StandIn::deviceAddress(Device));
+    appendString(Dict, "AddressType", "public");
+    if (!Target || Objects.TargetNamed) {
+      appendString(Dict, "Name", Name);
+      appendString(Dict, "Alias", Name);
+    } else {
+      auto Alias = StandIn::deviceAddress(Device);
+      for (auto &Char: Alias) if (Char == ':') Char = '-';
+      appendString(Dict, "Alias", Alias);
+    }
+    appendVariant(Dict, "Class", DBUS_TYPE_UINT32, "u",
+                  dbus_uint32_t(Target || Stale? 0x001f00 : 0x5a020c));
+    appendString(Dict, "Icon", Target || Stale? "input-keyboard" : "phone");
+    appendBool(Dict, "Paired", Stale || (Target && Objects.TargetPaired));
+    appendBool(Dict, "Trusted", Stale || (Target && Objects.TargetPaired));
+    appendBool(Dict, "Blocked", false);
+    appendBool(Dict, "LegacyPairing", Target || Stale);
+    if (!Stale) {
+      appendVariant(Dict, "RSSI", DBUS_TYPE_INT16, "n",
+                    dbus_int16_t(-40 - int(Device % 50)));
+    }
+    appendBool(Dict, "Connected", false);
+    if (Target && Objects.ProfilesAfterPairing) {
+      if (!Objects.TargetPaired) {
+        appendStrings(Dict, "UUIDs", {});
+      } else if (Objects.TargetHID) {
+        appendStrings(Dict, "UUIDs", { SPP, HID });
+      } else {
+        appendStrings(Dict, "UUIDs", { SPP, Battery });
+      }
+    } else if (Target || Stale) {
+      appendStrings(Dict, "UUIDs", { SPP, HID });
+    } else {
+      appendStrings(Dict, "UUIDs", { SPP, Battery });
+    }
+    appendString(Dict, "Modalias", "usb:v1D6Bp0246d0537");
+    if (Target) appendManufacturerData(Dict, 0x0a7b, { 0x01, 0x02, 0x42 });
+    appendPath(Dict, "Adapter", StandIn::adapterPath());
+    appendBool(Dict, "ServicesResolved", false);
+  }
+
+  // Appends one oa{sa{sv}} entry with a single interface.
+  template<typename Fill>
+  void appendObject(DBusMessageIter *Objects, std::string const &Path,
+                    char const *Interface, Fill const &Properties) {
+    DBusMessageIter Entry, Interfaces, InterfaceEntry, Dict;
+    char const *PathString = Path.c_str();
+
+    check(dbus_message_iter_open_container(Objects, DBUS_TYPE_DICT_ENTRY,
+                                           nullptr, &Entry));
+    check(dbus_message_iter_append_basic(&Entry, DBUS_TYPE_OBJECT_PATH,
+                                         &PathString));
+    check(dbus_message_iter_open_container(&Entry, DBUS_TYPE_ARRAY,
+                                           "{sa{sv}}", &Interfaces));
+    check(dbus_message_iter_open_container(&Interfaces, DBUS_TYPE_DICT_ENTRY,
+                                           nullptr, &InterfaceEntry));
+    check(dbus_message_iter_append_basic(&InterfaceEntry, DBUS_TYPE_STRING,
+                                         &Interface));
+    check(dbus_message_iter_open_container(&InterfaceEntry, DBUS_TYPE_ARRAY,
+                                           "{sv}", &Dict));
+    Properties(&Dict);
+    check(dbus_message_iter_close_container(&InterfaceEntry, &Dict));
+    check(dbus_message_iter_close_container(&Interfaces, &InterfaceEntry));
+    check(dbus_message_iter_close_container(&Entry, &Interfaces));
+    check(dbus_message_iter_close_container(Objects, &Entry));
+  }
+
+  void appendDeviceObjects(DBusMessageIter *Objects,
+                           StandIn::Population const &Known,
+                           unsigned Device) {
+    auto const Path = StandIn::devicePath(Device);
+
+    appendObject(Objects, Path, DeviceInterface, [&](DBusMessageIter *Dict) {
+      appendDeviceProperties(Dict, Known, Device);
+    });
+    for (unsigned I = 0; I < Known.ServicesPerDevice; ++I) {
+      char Service[16];
+      snprintf(Service, sizeof(Service), "/service%04x", 0x10 * (I + 1));
+      appendObject(Objects, Path + Service, "org.bluez.GattService1",
+                   [&](DBusMessageIter *Dict) {
+        appendString(Dict, "UUID", Battery);
+        appendPath(Dict, "Device", Path);
+        appendBool(Dict, "Primary", true);
+      });
+      appendObject(Objects, Path + Service + "/char0001",
+                   "org.bluez.GattCharacteristic1", [&](DBusMessageIter *Dict) {
+        appendString(Dict, "UUID", "00002a19-0000-1000-8000-00805f9b34fb");
+        appendPath(Dict, "Service", Path + Service);
+        appendStrings(Dict, "Flags", { "read", "notify" });
+      });
+    }
+  }
+} // namespace
+
+std::string const &StandIn::adapterPath()
+{
+  static std::string const Path = "/org/bluez/hci0";
+
+  return Path;
+}
+
+std::string StandIn::deviceAddress(unsigned Device)
+{
+  char Address[18];
+
+  snprintf(Address, sizeof(Address), "00:07:80:%02X:%02X:%02X",
+           (Device >> 16) & 0xFF, (Device >> 8) & 0xFF, Device & 0xFF);
+
+  return Address;
+}
+
+std::string StandIn::devicePath(unsigned Device)
+{
+  auto Path = adapterPath() + "/dev_" + deviceAddress(Device);
+
+  for (auto &Char: Path) if (Char == ':') Char = '_';
+
+  return Path;
+}
+
+DBusMessage *
+StandIn::managedObjects(DBusMessage *Call, Population const &Objects)
+{
+  auto Reply = check(dbus_message_new_method_return(Call));
+  DBusMessageIter Args, Dict;
+
+  dbus_message_iter_init_append(Reply, &Args);
+  check(dbus_message_iter_open_container(&Args, DBUS_TYPE_ARRAY,
+                                         "{oa{sa{sv}}}", &Dict));
+  appendObject(&Dict, "/org/bluez", "org.bluez.AgentManager1",
+               [](DBusMessageIter *) {});
+  appendObject(&Dict, adapterPath(), AdapterInterface, appendAdapterProperties);
+  for (unsigned Device = Objects.TargetKnown? 0 : 1; Device < Objects.Devices;
+       ++Device) {
+    appendDeviceObjects(&Dict, Objects, Device);
+  }
+  check(dbus_message_iter_close_container(&Args, &Dict));
+
+  return Reply;
+}
+
+DBusMessage *
+StandIn::interfacesAdded(Population const &Objects, unsigned Device)
+{
+  auto Signal = check(dbus_message_new_signal
+    ("/", "org.freedesktop.DBus.ObjectManager", "InterfacesAdded"));
+  auto const Path = devicePath(Device);
+  char const *PathString = Path.c_str();
+  DBusMessageIter Args, Interfaces, Entry, Dict;
+
+  dbus_message_iter_init_append(Signal, &Args);
+  check(dbus_message_iter_append_basic(&Args, DBUS_TYPE_OBJECT_PATH,
+                                       &PathString));
+  check(dbus_message_iter_open_container(&Args, DBUS_TYPE_ARRAY,
+                                         "{sa{sv}}", &Interfaces));
+  check(dbus_message_iter_open_container(&Interfaces, DBUS_TYPE_DICT_ENTRY,
+                                         nullptr, &Entry));
+  check(dbus_message_iter_append_basic(&Entry, DBUS_TYPE_STRING,
+                                       &DeviceInterface));
+  check(dbus_message_iter_open_container(&Entry, DBUS_TYPE_ARRAY,
+                                         "{sv}", &Dict));
+  appendDeviceProperties(&Dict, Objects, Device);
+  check(dbus_message_iter_close_container(&Entry, &Dict));
+  check(dbus_message_iter_close_container(&Interfaces, &Entry));
+  check(dbus_message_iter_close_container(&Args, &Interfaces));
+
+  return Signal;
+}
+
+DBusMessage *StandIn::interfacesRemoved(unsigned Device)
+{
+  auto Signal = check(dbus_message_new_signal
+    ("/", "org.freedesktop.DBus.ObjectManager", "InterfacesRemoved"));
+  auto const Path = devicePath(Device);
+  char const *PathString = Path.c_str();
+  DBusMessageIter Args, Interfaces;
+
+  dbus_message_iter_init_append(Signal, &Args);
+  check(dbus_message_iter_append_basic(&Args, DBUS_TYPE_OBJECT_PATH,
+                                       &PathString));
+  check(dbus_message_iter_open_container(&Args, DBUS_TYPE_ARRAY,
+                                         "s", &Interfaces));
+  check(dbus_message_iter_append_basic(&Interfaces, DBUS_TYPE_STRING,
+                                       &DeviceInterface));
+  check(dbus_message_iter_close_container(&Args, &Interfaces));
+
+  return Signal;
+}
+
+namespace {
+  template<typename Fill>
+  DBusMessage *propertiesChanged(std::string const &Path,
+                                 char const *Interface, Fill const &Changed) {
+    auto Signal = check(dbus_message_new_signal
+      (Path.c_str(), "org.freedesktop.DBus.Properties", "PropertiesChanged"));
+    DBusMessageIter Args, Dict, Invalidated;
+
+    dbus_message_iter_init_append(Signal, &Args);
+    check(dbus_message_iter_append_basic(&Args, DBUS_TYPE_STRING, &Interface));
+    check(dbus_message_iter_open_container(&Args, DBUS_TYPE_ARRAY,
+                                           "{sv}", &Dict));
+    Changed(&Dict);
+    check(dbus_message_iter_close_container(&Args, &Dict));
+    check(dbus_message_iter_open_container(&Args, DBUS_TYPE_ARRAY,
+                                           "s", &Invalidated));
+    check(dbus_message_iter_close_container(&Args, &Invalidated));
+
+    return Signal;
+  }
+} // namespace
+
+DBusMessage *StandIn::propertyChanged(std::string const &Path,
+                                      char const *Interface,
+                                      char const *Property, bool Value)
+{
+  return propertiesChanged(Path, Interface, [&](DBusMessageIter *Dict) {
+    appendBool(Dict, Property, Value);
+  });
+}
+
+DBusMessage *StandIn::rssiChanged(unsigned Device, dbus_int16_t RSSI)
+{
+  return propertiesChanged(devicePath(Device), DeviceInterface,
+                           [&](DBusMessageIter *Dict) {
+    appendVariant(Dict, "RSSI", DBUS_TYPE_INT16, "n", RSSI);
+  });
+}
+
+StandIn::Daemon::Daemon()
+{
+  char Directory[] = "/tmp/bluepairy-standin-XXXXXX";
+
+  if (mkdtemp(Directory) == nullptr) {
+    throw std::system_error(errno, std::generic_category(), "mkdtemp");
+  }
+  ConfigDirectory = Directory;
+
+  auto const Config = ConfigDirectory + "/bus.conf";
+  std::ofstream(Config)
+    << "<!DOCTYPE busconfig PUBLIC"
+       " \"-//freedesktop//DTD D-Bus Bus Configuration 1.0//EN\""
+       " \"http://www.freedesktop.org/standards/dbus/1.0/busconfig.dtd\">\n"
+       "<busconfig>\n"
+       "  <type>session</type>\n"
+       "  <listen>unix:tmpdir=" << ConfigDirectory << "</listen>\n"
+       "  <auth>EXTERNAL</auth>\n"
+       "  <policy context=\"default\">\n"
+       "    <allow send_destination=\"*\" eavesdrop=\"true\"/>\n"
+       "    <allow eavesdrop=\"true\"/>\n"
+       "    <allow own=\"*\"/>\n"
+       "  </policy>\n"
+       "</busconfig>\n";
+
+  int Pipe[2];
+  if (pipe(Pipe) == -1) {
+    throw std::system_error(errno, std::generic_category(), "pipe");
+  }
+
+  Pid = fork();
+  if (Pid == -1) {
+    throw std::system_error(errno, std::generic_category(), "fork");
+  }
+  if (Pid == 0) {
+    auto const Program = getenv("DBUS_DAEMON")? getenv("DBUS_DAEMON")
+                                              : "dbus-daemon";
+    auto const ConfigFile = "--config-file=" + Config;
+    auto const PrintAddress = "--print-address=" + std::to_string(Pipe[1]);
+
+    close(Pipe[0]);
+    execlp(Program, Program, "--nofork", ConfigFile.c_str(),
+           PrintAddress.c_str(), static_cast<char *>(nullptr));
+    perror(Program);
+    _exit(127);
+  }
+  close(Pipe[1]);
+
+  char Buffer[512];
+  ssize_t Count;
+  while ((Count = read(Pipe[0], Buffer, sizeof(Buffer))) > 0) {
+    Address.append(Buffer, Count);
+    if (Address.back() == '\n') break;
+  }
+  close(Pipe[0]);
+
+  if (Address.empty()) {
+    waitpid(Pid, nullptr, 0);
+    throw std::runtime_error("dbus-daemon did not report its address");
+  }
+  Address.pop_back();
+}
+
+StandIn::Daemon::~Daemon()
+{
+  kill(Pid, SIGTERM);
+  waitpid(Pid, nullptr, 0);
+  unlink((ConfigDirectory + "/bus.conf").c_str());
+  rmdir(ConfigDirectory.c_str());
+}
+
+StandIn::Service::Service(std::string const &Address, Population Objects)
+: Objects(std::move(Objects))
+{
+  DBusError Error;
+  dbus_error_init(&Error);
+
+  Bus = dbus_connection_open_private(Address.c_str(), &Error);
+  if (Bus == nullptr || dbus_bus_register(Bus, &Error) == FALSE ||
+      dbus_bus_request_name(Bus, "org.bluez", DBUS_NAME_FLAG_DO_NOT_QUEUE,
+                            &Error) != DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER) {
+    std::runtime_error E(dbus_error_is_set(&Error)? Error.message
+                         : "Failed to own org.bluez on the stand-in bus");
+    dbus_error_free(&Error);
+    if (Bus) {
+      dbus_connection_close(Bus);
+      dbus_connection_unref(Bus);
+    }
+    throw E;
+  }
+
+  Thread = std::thread([this] {
+    while (!Stop.load(std::memory_order_relaxed) &&
+           dbus_connection_read_write(Bus, 20) == TRUE) {
+      DBusMessage *Message;
+
+      while ((Message = dbus_connection_pop_message(Bus))) {
+        if (dbus_message_get_type(Message) == DBUS_MESSAGE_TYPE_METHOD_CALL) {
+          handle(Message);
+        }
+        dbus_message_unref(Message);
+      }
+    }
+  });
+}
+
+StandIn::Service::~Service()
+{
+  Stop = true;
+  Thread.join();
+  dbus_connection_close(Bus);
+  dbus_connection_unref(Bus);
+}
+
+void StandIn::Service::handle(DBusMessage *Call)
+{
+  auto const Member = std::string(dbus_message_get_member(Call));
+  auto const Path = std::string(dbus_message_get_path(Call));
+  auto send = [this](DBusMessage *Message) {
+    dbus_connection_send(Bus, Message, nullptr);
+    dbus_message_unref(Message);
+  };
+
+  if (Member == "GetManagedObjects") {
+    send(managedObjects(Call, Objects));
+    return;
+  }
+
+  if (Member == "RegisterAgent") {
+    char const *Agent;
+    char const *Capability;
+
+    if (dbus_message_get_args(Call, nullptr,
+                              DBUS_TYPE_OBJECT_PATH, &Agent,
+                              DBUS_TYPE_STRING, &Capability,
+                              DBUS_TYPE_INVALID) == TRUE) {
+      AgentOwner = dbus_message_get_sender(Call);
+      AgentPath = Agent;
+    }
+  } else if (Member == "Pair" && Path == devicePath(0)) {
+    if (Objects.PairFailures > 0) {
+      Objects.PairFailures -= 1;
+      send(check(dbus_message_new_error(Call, Objects.PairError.c_str(),
+                                        "Pairing failed")));
+      return;
+    }
+    if (!AgentOwner.empty()) {
+      auto Request = check(dbus_message_new_method_call
+        (AgentOwner.c_str(), AgentPath.c_str(),
+         "org.bluez.Agent1", "RequestPinCode"));
+      auto const Device = devicePath(0);
+      char const *DeviceString = Device.c_str();
+      DBusPendingCall *Pending = nullptr;
+
+      dbus_message_append_args(Request,
+                               DBUS_TYPE_OBJECT_PATH, &DeviceString,
+                               DBUS_TYPE_INVALID);
+      dbus_connection_send_with_reply(Bus, Request, &Pending, 15000);
+      dbus_message_unref(Request);
+      if (!Objects.TargetNamed) {
+        auto const &Name = Objects.TargetName;
+        Objects.TargetNamed = true;
+        send(propertiesChanged(Path, DeviceInterface,
+                               [&Name](DBusMessageIter *Dict) {
+                                 appendString(Dict, "Name", Name);
+                                 appendString(Dict, "Alias", Name);
+                               }));
+      }
+
+      DBusMessage *Reply = nullptr;
+      if (Pending) {
+        dbus_pending_call_block(Pending);
+        Reply = dbus_pending_call_steal_reply(Pending);
+        dbus_pending_call_unref(Pending);
+      }
+      char const *PIN = nullptr;
+      if (Reply == nullptr ||
+          dbus_message_get_type(Reply) == DBUS_MESSAGE_TYPE_ERROR) {
+        if (Reply) dbus_message_unref(Reply);
+        send(check(dbus_message_new_error
+          (Call, "org.bluez.Error.AuthenticationCanceled",
+           "Authentication Canceled")));
+        return;
+      }
+      dbus_message_get_args(Reply, nullptr, DBUS_TYPE_STRING, &PIN,
+                            DBUS_TYPE_INVALID);
+      bool const Accepted = Objects.PIN.empty() ||
+                            (PIN != nullptr && Objects.PIN == PIN);
+      dbus_message_unref(Reply);
+      if (!Accepted) {
+        send(check(dbus_message_new_error
+          (Call, "org.bluez.Error.AuthenticationFailed",
+           "Authentication Failed")));
+        return;
+      }
+    }
+    Objects.TargetPaired = true;
+    send(propertyChanged(Path, DeviceInterface, "Paired", true));
+    if (Objects.ProfilesAfterPairing && Objects.TargetResolves) {
+      auto const &Known = Objects;
+      send(propertiesChanged(Path, DeviceInterface, [&](DBusMessageIter *Dict) {
+        if (Known.TargetHID) {
+          appendStrings(Dict, "UUIDs", { SPP, HID });
+        } else {
+          appendStrings(Dict, "UUIDs", { SPP, Battery });
+        }
+        appendBool(Dict, "ServicesResolved", true);
+      }));
+    }
+  } else if (Member == "Set") {
+    char const *Interface;
+    char const *Property;
+    DBusMessageIter Args, Variant;
+    dbus_bool_t Value = FALSE;
+
+    dbus_message_iter_init(Call, &Args);
+    dbus_message_iter_get_basic(&Args, &Interface);
+    dbus_message_iter_next(&Args);
+    dbus_message_iter_get_basic(&Args, &Property);
+    dbus_message_iter_next(&Args);
+    dbus_message_iter_recurse(&Args, &Variant);
+    if (dbus_message_iter_get_arg_type(&Variant) == DBUS_TYPE_BOOLEAN) {
+      dbus_message_iter_get_basic(&Variant, &Value);
+    }
+    send(propertyChanged(Path, Interface, Property, Value == TRUE));
+  } else if (Member == "ConnectProfile") {
+    send(propertyChanged(Path, DeviceInterface, "Connected", true));
+  } else if (Member == "StartDiscovery") {
+    send(propertyChanged(Path, AdapterInterface, "Discovering", true));
+    // Inquiry results from everything in range.
+    for (unsigned I = 0; I < Objects.Devices; ++I) {
+      if (I == 0 || I > Objects.StalePairings) {
+        send(rssiChanged(I, dbus_int16_t(-40 - int(I % 50))));
+      }
+    }
+  } else if (Member == "ConnectDevice") {
+    if (!Objects.TargetKnown) {
+      auto const Device = devicePath(0);
+      char const *DeviceString = Device.c_str();
+      auto Reply = check(dbus_message_new_method_return(Call));
+
+      Objects.TargetKnown = true;
+      send(interfacesAdded(Objects, 0));
+      dbus_message_append_args(Reply, DBUS_TYPE_OBJECT_PATH, &DeviceString,
+                               DBUS_TYPE_INVALID);
+      send(Reply);
+    } else {
+      send(check(dbus_message_new_error(Call, "org.bluez.Error.AlreadyExists",
+                                        "Already Exists")));
+    }
+    return;
+  } else if (Member == "RemoveDevice") {
+    char const *Device;
+
+    if (!Objects.RemoveError.empty()) {
+      send(check(dbus_message_new_error(Call, Objects.RemoveError.c_str(),
+                                        "Removal failed")));
+      return;
+    }
+
+    if (dbus_message_get_args(Call, nullptr,
+                              DBUS_TYPE_OBJECT_PATH, &Device,
+                              DBUS_TYPE_INVALID) == TRUE) {
+      for (unsigned I = 0; I < Objects.Devices; ++I) {
+        if (devicePath(I) == Device) send(interfacesRemoved(I));
+      }
+    }
+  }
+
+  send(check(dbus_message_new_method_return(Call)));
+}
@@ -0,0 +1,90 @@
+#if !defined(STANDIN_HPP)
+#define STANDIN_HPP
+
+#include <atomic>
+#include <string>
+#include <thread>
+
+#include <dbus/dbus.h>
+#include <sys/types.h>
+
+// A private bus with a minimal org.bluez on it, so that benchmarks can run
+// without Bluetooth hardware and without touching the system bus.
+namespace StandIn {
+  // What the stand-in BlueZ pretends to know about.  The first device is
+  // the target, all others are bystanders.
+  struct Population {
+    unsigned Devices = 1;
+    // GATT services (with one characteristic each) below every device.
+    unsigned ServicesPerDevice = 0;
+    bool TargetPaired = false;
+    // Without an object for the target, Adapter1.ConnectDevice creates it.
+    bool TargetKnown = true;
+    // Whether the remote name request for the target has completed.  If
+    // not, the name arrives while Pair waits for the PIN.
+    bool TargetNamed = true;
+    // If set, Pair fails unless the agent answers with this PIN.
+    std::string PIN;
+    // Like BR/EDR devices before SDP, the target lists no UUIDs until it
+    // is paired.  Then it resolves to HID, or to a battery if not TargetHID.
+    bool ProfilesAfterPairing = false;
+    bool TargetHID = true;
+    // If not, service discovery after pairing never completes.
+    bool TargetResolves = true;
+    // The first PairFailures calls to Pair return this D-Bus error.
+    unsigned PairFailures = 0;
+    std::string PairError = "org.bluez.Error.ConnectionAttemptFailed";
+    // Bystanders 1 to StalePairings are paired earlier targets which are
+    // out of range.
+    unsigned StalePairings = 0;
+    // If set, RemoveDevice returns this D-Bus error.
+    std::string RemoveError;
+    std::string TargetName = "Active Star AS4/A4-12345";
+  };
+
+  std::string const &adapterPath();
+  std::string devicePath(unsigned Device);
+  std::string deviceAddress(unsigned Device);
+
+  // Messages as BlueZ would send them.
+  DBusMessage *managedObjects(DBusMessage *Call, Population const &);
+  DBusMessage *interfacesAdded(Population const &, unsigned Device);
+  DBusMessage *interfacesRemoved(unsigned Device);
+  DBusMessage *propertyChanged(std::string const &Path, char const *Interface,
+                               char const *Property, bool Value);
+  DBusMessage *rssiChanged(unsigned Device, dbus_int16_t RSSI);
+
+  // dbus-daemon on a private socket.  $DBUS_DAEMON overrides the binary.
+  class Daemon final {
+    pid_t Pid;
+    std::string ConfigDirectory;
+    std::string Address;
+
+  public:
+    Daemon();
+    Daemon(Daemon const &) = delete;
+    Daemon &operator=(Daemon const &) = delete;
+    ~Daemon();
+
+    std::string const &address() const { return Address; }
+  };
+
+  // Serves org.bluez on its own connection and thread.
+  class Service final {
+    Population Objects;
+    DBusConnection *Bus;
+    std::atomic<bool> Stop{false};
+    std::thread Thread;
+    std::string AgentOwner, AgentPath;
+
+    void handle(DBusMessage *);
+
+  public:
+    Service(std::string const &Address, Population);
+    Service(Service const &) = delete;
+    Service &operator=(Service const &) = delete;
+    ~Service();
+  };
+}
+
+#endif // STANDIN_HPP
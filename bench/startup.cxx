@@ -0,0 +1,160 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+
+#include <boost/program_options.hpp>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "bluepairy.hxx"
+#include "standin.hxx"
+
+// Measures how long bluepairy takes from process start until its device
+// model is loaded.  Every run forks and execs this very binary, which links
+// the same libraries as the command line tool, against a stand-in BlueZ on
+// a private bus.
+
+namespace {
+  using nanoseconds = std::chrono::nanoseconds;
+  using steady_clock = std::chrono::steady_clock;
+
+  long long now() {
+    return std::chrono::duration_cast<nanoseconds>
+      (steady_clock::now().time_since_epoch()).count();
+  }
+
+  int child(long long MainEntered) {
+    auto Bus = dbus_bus_get_private(DBUS_BUS_SYSTEM, nullptr);
+    if (!Bus) return EXIT_FAILURE;
+    auto const Connected = now();
+
+    {
+      Bluepairy Bluetooth(".", {}, Bus);
+      auto const ModelReady = now();
+
+      std::cout << MainEntered << ' ' << Connected << ' ' << ModelReady
+                << std::endl;
+    }
+
+    dbus_connection_close(Bus);
+    dbus_connection_unref(Bus);
+
+    return EXIT_SUCCESS;
+  }
+
+  struct Sample {
+    long long Main, Connected, ModelReady;
+  };
+
+  bool run(Sample &Result) {
+    int Pipe[2];
+    if (pipe(Pipe) == -1) return false;
+
+    auto const Started = now();
+    auto const Pid = fork();
+    if (Pid == -1) return false;
+    if (Pid == 0) {
+      close(Pipe[0]);
+      dup2(Pipe[1], STDOUT_FILENO);
+      close(Pipe[1]);
+      execl("/proc/self/exe", "bluepairy-startup-bench", "--child",
+            static_cast<char *>(nullptr));
+      _exit(127);
+    }
+    close(Pipe[1]);
+
+    long long MainEntered = 0, Connected = 0, ModelReady = 0;
+    auto Output = fdopen(Pipe[0], "r");
+    auto const Fields = fscanf(Output, "%lld %lld %lld",
+                               &MainEntered, &Connected, &ModelReady);
+    fclose(Output);
+
+    int Status;
+    waitpid(Pid, &Status, 0);
+    if (Fields != 3 || !WIFEXITED(Status) || WEXITSTATUS(Status) != 0) {
+      return false;
+    }
+
+    Result.Main = MainEntered - Started;
+    Result.Connected = Connected - Started;
+    Result.ModelReady = ModelReady - Started;
+
+    return true;
+  }
+
+  void report(char const *Name, std::vector<long long> Values) {
+    std::sort(Values.begin(), Values.end());
+    auto us = [](long long Value) { return Value / 1000; };
+
+    std::cout << Name << ": min " << us(Values.front())
+              << "us, median " << us(Values[Values.size() / 2])
+              << "us, max " << us(Values.back()) << "us" << std::endl;
+  }
+} // namespace
+
+int main(int argc, char *argv[])
+{
+  auto const MainEntered = now();
+  unsigned Runs = 20;
+  StandIn::Population Objects;
+
+  namespace po = boost::program_options;
+  po::options_description Desc("Allowed options");
+  Desc.add_options()
+  ("help,?", "print usage message")
+  ("devices", po::value(&Objects.Devices)->default_value(20),
+   "Number of devices known to the stand-in BlueZ")
+  ("services", po::value(&Objects.ServicesPerDevice)->default_value(0),
+   "GATT services below every device")
+  ("runs", po::value(&Runs)->default_value(20), "Number of process starts")
+  ;
+  po::options_description Hidden;
+  Hidden.add_options()("child", "");
+  po::options_description All;
+  All.add(Desc).add(Hidden);
+
+  po::variables_map VariablesMap;
+  try {
+    store(po::parse_command_line(argc, argv, All), VariablesMap);
+    notify(VariablesMap);
+  } catch (po::error &E) {
+    std::cerr << E.what() << std::endl << std::endl << Desc << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  if (VariablesMap.count("child") > 0) return child(MainEntered);
+
+  if (VariablesMap.count("help") > 0 || Runs == 0) {
+    std::cout << Desc << std::endl;
+    return EXIT_SUCCESS;
+  }
+
+  StandIn::Daemon Daemon;
+  StandIn::Service BlueZ(Daemon.address(), Objects);
+  setenv("DBUS_SYSTEM_BUS_ADDRESS", Daemon.address().c_str(), 1);
+
+  std::vector<long long> Main, Connected, ModelReady;
+  for (unsigned I = 0; I < Runs; ++I) {
+    Sample Result;
+
+    if (!run(Result)) {
+      std::cerr << "Run " << I + 1 << " failed" << std::endl;
+      return EXIT_FAILURE;
+    }
+    Main.push_back(Result.Main);
+    Connected.push_back(Result.Connected);
+    ModelReady.push_back(Result.ModelReady);
+  }
+
+  std::cout << Runs << " runs, " << Objects.Devices << " devices, "
+            << Objects.ServicesPerDevice << " services per device"
+            << std::endl;
+  report("time-to-main", Main);
+  report("time-to-connected-bus", Connected);
+  report("time-to-model-ready", ModelReady);
+
+  return EXIT_SUCCESS;
+}
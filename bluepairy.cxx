@@ -1,156 +1,25 @@
+#include <array>
+#include <atomic>
+#include <cassert>
+#include <cctype>
 #include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <cstring>
 #include <iostream>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <unordered_map>
 
-#include <boost/program_options.hpp>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
 
 #include "bluepairy.hxx"
-
-int main(int argc, char *argv[])
-{
-  std::string FriendlyName;
-  std::vector<std::string> UUIDs;
-
-  using command_line_parser = boost::program_options::command_line_parser;
-  using invalid_command_line_syntax = boost::program_options::invalid_command_line_syntax;
-  using options_description = boost::program_options::options_description;
-  using positional_options_description = boost::program_options::positional_options_description;
-  using required_option = boost::program_options::required_option;
-  using minutes = std::chrono::minutes;
-  using SteadyClock = std::chrono::steady_clock;
-  using unknown_option = boost::program_options::unknown_option;
-  using variables_map = boost::program_options::variables_map;
-
-  options_description Desc("Allowed options");
-  Desc.add_options()
-  ("help,?", "print usage message")
-  ("friendly-name,n", boost::program_options::value(&FriendlyName)->required(),
-   "Device name (regex)")
-  ("connect,c", boost::program_options::value(&UUIDs), "UUID (regex)")
-  ("hid", "Connect to Human Interface Device Service")
-  ;
-
-  positional_options_description PositionalDesc;
-  PositionalDesc.add("friendly-name", 1);
-  variables_map VariablesMap;
-  try {
-    store(command_line_parser(argc, argv)
-          .options(Desc)
-          .positional(PositionalDesc)
-          .run(), VariablesMap);
-    notify(VariablesMap);
-  } catch (unknown_option &E) {
-    std::cerr << E.what() << std::endl << std::endl << Desc << std::endl;
-    return EXIT_FAILURE;
-  } catch (required_option &E) {
-    std::cerr << E.what() << std::endl << std::endl << Desc << std::endl;
-    return EXIT_FAILURE;
-  } catch (invalid_command_line_syntax &E) {
-    std::cerr << E.what () << std::endl << Desc << std::endl;
-    return EXIT_FAILURE;
-  }
-
-  if (VariablesMap.count("help") > 0) {
-    std::cout << Desc << std::endl;
-    return EXIT_SUCCESS;
-  }
-
-  if (FriendlyName.empty()) {
-    std::cerr << "Empty friendly name is not allowed." << std::endl;
-    return EXIT_FAILURE;
-  }
-
-  for (auto const &UUID: UUIDs) {
-    if (UUID.empty()) {
-      std::cerr << "Empty UUIDs are not allowed." << std::endl;
-      return EXIT_FAILURE;
-    }
-  }
-
-  if (VariablesMap.count("hid") > 0) {
-    UUIDs.push_back("00001124-0000-1000-8000-00805f9b34fb");
-  }
-
-  if (!UUIDs.empty()) {
-    std::cout << "Bluetooth Profile UUIDs required to be offered by "
-              << "the device:" << std::endl;
-    copy(begin(UUIDs), end(UUIDs),
-         std::ostream_iterator<std::string>(std::cout, "\n"));
-  }
-
-  Bluepairy Bluetooth(FriendlyName, UUIDs);
-  auto StartTime = SteadyClock::now();
-
-  Bluetooth.powerUpAllAdapters();
-
-  if (Bluetooth.poweredAdapters().empty()) {
-    std::cout << "No Bluetooth adapters available yet." << std::endl;
-  }
-
-  while (Bluetooth.usableDevices().empty()) {
-    Bluetooth.readWrite();
-
-    {
-      auto PairableDevices = Bluetooth.pairableDevices();
-
-      if (!PairableDevices.empty()) {
-        for (auto Device: PairableDevices) {
-          std::clog << "Trying to pair with " << Device->name() << std::endl;
-          try {
-            Bluetooth.pair(Device);
-            std::clog << "Paired successfully with "
-                      << Device->name() << std::endl;
-            Bluetooth.trust(Device);
-          } catch (BlueZ::Error &E) {
-            std::cerr << "Failed to pair with " << Device->name()
-                      << ": " << E.what() << std::endl;
-          }
-        }
-      } else if (!Bluetooth.isDiscovering()) {
-        if (Bluetooth.startDiscovery()) {
-          std::cout << "Started discovery mode" << std::endl;
-        }
-      }
-    }
-
-    if (SteadyClock::now() - StartTime > minutes(5)) {
-      std::cout << "Giving up, sorry." << std::endl;
-
-      return EXIT_FAILURE;
-    }
-  }
-
-  auto UsableDevices = Bluetooth.usableDevices();
-
-  if (UsableDevices.size() == 1) {
-    auto Device = UsableDevices.front();
-    for (auto UUID: UUIDs) {
-      std::clog << "Trying to connect to " << UUID << std::endl;
-      try {
-        Device->connectProfile(UUID);
-      } catch (BlueZ::Error &E) {
-        std::cerr << "Failed to connect to " << UUID << ": " << E.what()
-                  << std::endl;
-        return EXIT_FAILURE;
-      }
-    }
-  }
-
-  if (!UsableDevices.empty()) {
-    std::cout << "Found "
-              << (UsableDevices.size() == 1? "one matching device"
-                  : "several usable matches")
-              << ":" << std::endl;
-    for (auto Device: UsableDevices) {
-      std::cout << Device->name() << " (" << Device->address()
-                << ") paired via " << Device->adapter()->address()
-                << std::endl;
-    }
-
-    return EXIT_SUCCESS;
-  }
-
-  return EXIT_FAILURE;
-}
+#include "flight.hxx"
+#include "ringbuffer.hxx"
+#include "trace.hxx"
 
 namespace {
   void throwIfErrorIsSet(DBusError &Error) {
@@ -163,6 +32,11 @@ namespace {
         BlueZ::AlreadyExists E(Error.message);
         dbus_error_free(&Error);
         throw E;
+      } else if (strcmp("org.bluez.Error.AuthenticationCanceled",
+                        Error.name) == 0) {
+        BlueZ::AuthenticationCanceled E(Error.message);
+        dbus_error_free(&Error);
+        throw E;
       } else if (strcmp("org.bluez.Error.AuthenticationFailed",
                         Error.name) == 0) {
         BlueZ::AuthenticationFailed E(Error.message);
@@ -253,46 +127,286 @@ namespace BlueZ {
 
     explicit AgentManager(::Bluepairy *Pairy) : Object("/org/bluez", Pairy) {}
 
-    void registerAgent(char const *AgentPath, char const *Capabilities) const
+    DBus::PendingCall
+    beginRegisterAgent(char const *AgentPath, char const *Capabilities) const
     {
-      DBus::PendingCall PendingCall;
-
-      {
-        auto RegisterAgent = BlueZ::newMethodCall(path(), Interface, "RegisterAgent");
-
-        if (dbus_message_append_args
-            (RegisterAgent,
-             DBUS_TYPE_OBJECT_PATH, &AgentPath,
-             DBUS_TYPE_STRING, &Capabilities,
-             DBUS_TYPE_INVALID) == FALSE) {
-          throw std::runtime_error
-            ("Failed to append arguments to RegisterAgent message");
-        }
-
-        PendingCall.send(Bluepairy->SystemBus, std::move(RegisterAgent));
+      auto RegisterAgent = BlueZ::newMethodCall(path(), Interface, "RegisterAgent");
+
+      if (dbus_message_append_args
+          (RegisterAgent,
+           DBUS_TYPE_OBJECT_PATH, &AgentPath,
+           DBUS_TYPE_STRING, &Capabilities,
+           DBUS_TYPE_INVALID) == FALSE) {
+        throw std::runtime_error
+          ("Failed to append arguments to RegisterAgent message");
       }
 
-      dbus_message_unref(PendingCall.get());
+      return Bluepairy->call(std::move(RegisterAgent));
+    }
+
+    void registerAgent(char const *AgentPath, char const *Capabilities) const
+    {
+      dbus_message_unref(beginRegisterAgent(AgentPath, Capabilities).get());
     }
   };
 
   constexpr char const * const Adapter::Interface;
   constexpr char const * const Adapter::Property::Address;
   constexpr char const * const Adapter::Property::Discovering;
+  constexpr char const * const Adapter::Property::Name;
   constexpr char const * const Adapter::Property::Powered;
   constexpr char const * const Agent::Interface;
   constexpr char const * const AgentManager::Interface;
   constexpr char const * const Device::Interface;
+  constexpr unsigned Device::Changes::DetailBits;
+  constexpr dbus_int16_t Device::NoRSSI;
   constexpr char const * const Device::Property::Adapter;
   constexpr char const * const Device::Property::Address;
+  constexpr char const * const Device::Property::Appearance;
+  constexpr char const * const Device::Property::Blocked;
+  constexpr char const * const Device::Property::Class;
   constexpr char const * const Device::Property::Connected;
+  constexpr char const * const Device::Property::ManufacturerData;
+  constexpr char const * const Device::Property::Modalias;
   constexpr char const * const Device::Property::Name;
   constexpr char const * const Device::Property::Paired;
+  constexpr char const * const Device::Property::RSSI;
+  constexpr char const * const Device::Property::ServicesResolved;
   constexpr char const * const Device::Property::Trusted;
+  constexpr char const * const Device::Property::UUIDs;
+
+  bool decodeValue(DBusMessageIter &Value, bool &Into)
+  {
+    if (DBUS_TYPE_BOOLEAN != dbus_message_iter_get_arg_type(&Value)) {
+      return false;
+    }
+
+    dbus_bool_t BoolValue;
+    dbus_message_iter_get_basic(&Value, &BoolValue);
+    Into = BoolValue == TRUE;
+
+    return true;
+  }
+
+  template<int Type, typename T>
+  bool decodeBasic(DBusMessageIter &Value, T &Into)
+  {
+    if (Type != dbus_message_iter_get_arg_type(&Value)) return false;
+
+    dbus_message_iter_get_basic(&Value, &Into);
+
+    return true;
+  }
+
+  bool decodeValue(DBusMessageIter &Value, dbus_int16_t &Into)
+  {
+    return decodeBasic<DBUS_TYPE_INT16>(Value, Into);
+  }
+
+  bool decodeValue(DBusMessageIter &Value, dbus_uint16_t &Into)
+  {
+    return decodeBasic<DBUS_TYPE_UINT16>(Value, Into);
+  }
+
+  bool decodeValue(DBusMessageIter &Value, dbus_uint32_t &Into)
+  {
+    return decodeBasic<DBUS_TYPE_UINT32>(Value, Into);
+  }
+
+  bool decodeValue(DBusMessageIter &Value, std::string &Into)
+  {
+    auto const Type = dbus_message_iter_get_arg_type(&Value);
+    if (Type != DBUS_TYPE_STRING && Type != DBUS_TYPE_OBJECT_PATH) {
+      return false;
+    }
+
+    char const *StringValue;
+    dbus_message_iter_get_basic(&Value, &StringValue);
+    Into = StringValue? StringValue : "";
+
+    return true;
+  }
+
+  bool decodeValue(DBusMessageIter &Value, std::set<std::string> &Into)
+  {
+    if (DBUS_TYPE_ARRAY != dbus_message_iter_get_arg_type(&Value)) return false;
+
+    DBusMessageIter Strings;
+    dbus_message_iter_recurse(&Value, &Strings);
+
+    Into.clear();
+    while (DBUS_TYPE_STRING == dbus_message_iter_get_arg_type(&Strings)) {
+      char const *String;
+      dbus_message_iter_get_basic(&Strings, &String);
+
+      Into.insert(String);
+      dbus_message_iter_next(&Strings);
+    }
+
+    return true;
+  }
+
+  bool decodeValue(DBusMessageIter &Value /* a{qv} */,
+                   std::map<std::uint16_t, std::vector<std::uint8_t>> &Into)
+  {
+    if (DBUS_TYPE_ARRAY != dbus_message_iter_get_arg_type(&Value)) return false;
+
+    DBusMessageIter Entries;
+    dbus_message_iter_recurse(&Value, &Entries);
+
+    Into.clear();
+    while (DBUS_TYPE_DICT_ENTRY == dbus_message_iter_get_arg_type(&Entries)) {
+      DBusMessageIter Entry, Variant, Bytes;
+      dbus_uint16_t Company;
+      unsigned char const *Data;
+      int Length;
+
+      dbus_message_iter_recurse(&Entries, &Entry);
+      dbus_message_iter_get_basic(&Entry, &Company);
+      dbus_message_iter_next(&Entry);
+      dbus_message_iter_recurse(&Entry, &Variant);
+      if (DBUS_TYPE_ARRAY == dbus_message_iter_get_arg_type(&Variant) &&
+          DBUS_TYPE_BYTE == dbus_message_iter_get_element_type(&Variant)) {
+        dbus_message_iter_recurse(&Variant, &Bytes);
+        dbus_message_iter_get_fixed_array(&Bytes, &Data, &Length);
+        Into[Company].assign(Data, Data + Length);
+      }
+      dbus_message_iter_next(&Entries);
+    }
+
+    return true;
+  }
+
+  // A schema lists the properties of an interface we care about: their
+  // name, which Changes bit they set and into which member they decode.
+  template<typename Changes>
+  struct Field {
+    char const *Name;
+    unsigned Bit;
+    bool (*Decode)(DBusMessageIter &, Changes &);
+  };
+
+  template<typename Changes, typename T, T Changes::*Member>
+  bool decodeMember(DBusMessageIter &Value, Changes &Into)
+  {
+    return decodeValue(Value, Into.*Member);
+  }
+
+  // Where the values of properties outside the mask are, to decode them
+  // later without walking the dictionary again.
+  template<typename Changes>
+  struct Postponed {
+    std::array<std::pair<Field<Changes> const *, DBusMessageIter>, 8> Values;
+    std::size_t Size = 0;
+
+    void decode(Changes &Into) const {
+      for (std::size_t I = 0; I < Size; ++I) {
+        auto Value = Values[I].second;
+        if (Values[I].first->Decode(Value, Into)) {
+          Into.Set |= Values[I].first->Bit;
+        }
+      }
+    }
+  };
+
+  template<typename Changes, std::size_t Size>
+  void decodeProperties(DBusMessageIter &Properties /* {sa{sv}}... */,
+                        Changes &Into, Field<Changes> const (&Schema)[Size],
+                        unsigned Mask = ~0u,
+                        Postponed<Changes> *Later = nullptr)
+  {
+    while (DBUS_TYPE_DICT_ENTRY == dbus_message_iter_get_arg_type(&Properties)) {
+      DBusMessageIter Property;
+      dbus_message_iter_recurse(&Properties, &Property);
+      if (DBUS_TYPE_STRING == dbus_message_iter_get_arg_type(&Property)) {
+        char const *PropertyName;
+        dbus_message_iter_get_basic(&Property, &PropertyName);
+        dbus_message_iter_next(&Property);
+        if (DBUS_TYPE_VARIANT == dbus_message_iter_get_arg_type(&Property)) {
+          DBusMessageIter Value;
+          dbus_message_iter_recurse(&Property, &Value);
+          for (auto const &Field: Schema) {
+            if (strcmp(Field.Name, PropertyName) == 0) {
+              if (Field.Bit & Mask) {
+                if (Field.Decode(Value, Into)) Into.Set |= Field.Bit;
+              } else if (Later && Later->Size < Later->Values.size()) {
+                Later->Values[Later->Size++] = { &Field, Value };
+              }
+              break;
+            }
+          }
+          assert(!dbus_message_iter_has_next(&Property));
+        }
+      }
+      dbus_message_iter_next(&Properties);
+    }
+  }
+
+  using AdapterChanges = Adapter::Changes;
+  Field<AdapterChanges> const AdapterSchema[] = {
+    { Adapter::Property::Powered, AdapterChanges::PoweredBit,
+      decodeMember<AdapterChanges, bool, &AdapterChanges::Powered> },
+    { Adapter::Property::Discovering, AdapterChanges::DiscoveringBit,
+      decodeMember<AdapterChanges, bool, &AdapterChanges::Discovering> },
+    { Adapter::Property::Address, AdapterChanges::AddressBit,
+      decodeMember<AdapterChanges, std::string, &AdapterChanges::Address> },
+    { Adapter::Property::Name, AdapterChanges::NameBit,
+      decodeMember<AdapterChanges, std::string, &AdapterChanges::Name> }
+  };
+
+  // Most frequent first, RSSI and Connected change all the time.
+  using DeviceChanges = Device::Changes;
+  Field<DeviceChanges> const DeviceSchema[] = {
+    { Device::Property::RSSI, DeviceChanges::RSSIBit,
+      decodeMember<DeviceChanges, dbus_int16_t, &DeviceChanges::RSSI> },
+    { Device::Property::Connected, DeviceChanges::ConnectedBit,
+      decodeMember<DeviceChanges, bool, &DeviceChanges::Connected> },
+    { Device::Property::Name, DeviceChanges::NameBit,
+      decodeMember<DeviceChanges, std::string, &DeviceChanges::Name> },
+    { Device::Property::Address, DeviceChanges::AddressBit,
+      decodeMember<DeviceChanges, std::string, &DeviceChanges::Address> },
+    { Device::Property::Paired, DeviceChanges::PairedBit,
+      decodeMember<DeviceChanges, bool, &DeviceChanges::Paired> },
+    { Device::Property::Trusted, DeviceChanges::TrustedBit,
+      decodeMember<DeviceChanges, bool, &DeviceChanges::Trusted> },
+    { Device::Property::ServicesResolved, DeviceChanges::ServicesResolvedBit,
+      decodeMember<DeviceChanges, bool, &DeviceChanges::ServicesResolved> },
+    { Device::Property::Blocked, DeviceChanges::BlockedBit,
+      decodeMember<DeviceChanges, bool, &DeviceChanges::Blocked> },
+    { Device::Property::UUIDs, DeviceChanges::UUIDsBit,
+      decodeMember<DeviceChanges, std::set<std::string>,
+                   &DeviceChanges::UUIDs> },
+    { Device::Property::Class, DeviceChanges::ClassBit,
+      decodeMember<DeviceChanges, std::uint32_t, &DeviceChanges::Class> },
+    { Device::Property::Appearance, DeviceChanges::AppearanceBit,
+      decodeMember<DeviceChanges, std::uint16_t, &DeviceChanges::Appearance> },
+    { Device::Property::ManufacturerData, DeviceChanges::ManufacturerDataBit,
+      decodeMember<DeviceChanges,
+                   std::map<std::uint16_t, std::vector<std::uint8_t>>,
+                   &DeviceChanges::ManufacturerData> },
+    { Device::Property::Modalias, DeviceChanges::ModaliasBit,
+      decodeMember<DeviceChanges, std::string, &DeviceChanges::Modalias> },
+    { Device::Property::Adapter, DeviceChanges::AdapterBit,
+      decodeMember<DeviceChanges, std::string, &DeviceChanges::Adapter> }
+  };
 } // namespace BlueZ
 
+void DBus::PendingCall::Replayed::complete(DBusMessage *Message)
+{
+  if (Completed) return;
+
+  Reply = dbus_message_ref(Message);
+  Completed = true;
+  if (Notify) Notify();
+}
+
 DBus::PendingCall::PendingCall(PendingCall const &Other)
 : Pending(Other.Pending)
+, Replay(Other.Replay)
+, Recorder(Other.Recorder)
+, Tracer(Other.Tracer)
+, Serial(Other.Serial)
+, Sent(Other.Sent)
 {
   if (Pending) {
     dbus_pending_call_ref(Pending);
@@ -301,6 +415,11 @@ DBus::PendingCall::PendingCall(PendingCall const &Other)
 
 DBus::PendingCall::PendingCall(PendingCall &&Other)
 : Pending(Other.Pending)
+, Replay(std::move(Other.Replay))
+, Recorder(Other.Recorder)
+, Tracer(Other.Tracer)
+, Serial(Other.Serial)
+, Sent(Other.Sent)
 {
   Other.Pending = nullptr;
 }
@@ -314,6 +433,13 @@ DBus::PendingCall &DBus::PendingCall::operator=(PendingCall const &Other)
   if ((Pending = Other.Pending) != nullptr) {
     dbus_pending_call_ref(Pending);
   }
+  Replay = Other.Replay;
+  Recorder = Other.Recorder;
+  Tracer = Other.Tracer;
+  Serial = Other.Serial;
+  Sent = Other.Sent;
+
+  return *this;
 }
 
 DBus::PendingCall &DBus::PendingCall::operator=(PendingCall &&Other)
@@ -323,6 +449,13 @@ DBus::PendingCall &DBus::PendingCall::operator=(PendingCall &&Other)
   }
   Pending = Other.Pending;
   Other.Pending = nullptr;
+  Replay = std::move(Other.Replay);
+  Recorder = Other.Recorder;
+  Tracer = Other.Tracer;
+  Serial = Other.Serial;
+  Sent = Other.Sent;
+
+  return *this;
 }
 
 void DBus::PendingCall::send(DBusConnection *Bus, DBusMessage *&&Message)
@@ -334,13 +467,30 @@ void DBus::PendingCall::send(DBusConnection *Bus, DBusMessage *&&Message)
   dbus_message_unref(Message);
 }
 
+void DBus::PendingCall::recordTo(Flight::Recorder *Recorder, dbus_uint32_t Serial)
+{
+  this->Recorder = Recorder;
+  this->Serial = Serial;
+  Sent = std::chrono::steady_clock::now();
+}
+
 void DBus::PendingCall::block() const
 {
+  if (Replay) {
+    // Nothing else is going to answer.
+    if (!Replay->Completed) {
+      throw std::logic_error("No reply to this call in the trace");
+    }
+    return;
+  }
+
   dbus_pending_call_block(Pending);
 }
 
 bool DBus::PendingCall::ready() const
 {
+  if (Replay) return Replay->Completed;
+
   return dbus_pending_call_get_completed(Pending) == TRUE;
 }
 
@@ -348,13 +498,29 @@ DBusMessage *DBus::PendingCall::get() const
 {
   if (!ready()) block();
 
-  auto Reply = dbus_pending_call_steal_reply(Pending);
+  DBusMessage *Reply;
+  if (Replay) {
+    Reply = Replay->Reply;
+    Replay->Reply = nullptr;
+  } else {
+    Reply = dbus_pending_call_steal_reply(Pending);
+  }
 
   if (Reply == nullptr) {
     throw std::runtime_error
       ("DBus method call reply was null");
   }
 
+  // Replies bypass the filter, so this is where they are recorded.
+  if (Tracer) Tracer->write(Trace::Direction::Received, Reply);
+  if (Recorder) {
+    auto const Now = std::chrono::steady_clock::now();
+    Recorder->record(Flight::Producer::Main, Flight::Kind::Reply, Now,
+                     Flight::NoRow, nullptr,
+                     Recorder->intern(dbus_message_get_error_name(Reply)),
+                     Serial, Now - Sent);
+  }
+
   DBusError Error;
   dbus_error_init(&Error);
   if (dbus_set_error_from_message(&Error, Reply) == TRUE) {
@@ -365,6 +531,37 @@ DBusMessage *DBus::PendingCall::get() const
   return Reply;
 }
 
+void DBus::PendingCall::notify(std::function<void()> Function)
+{
+  if (Replay) {
+    Replay->Notify = std::move(Function);
+    return;
+  }
+
+  auto Data = new std::function<void()>(std::move(Function));
+
+  if (dbus_pending_call_set_notify
+      (Pending,
+       [](DBusPendingCall *, void *Data) {
+         (*static_cast<std::function<void()> *>(Data))();
+       },
+       Data,
+       [](void *Data) { delete static_cast<std::function<void()> *>(Data); })
+      == FALSE) {
+    delete Data;
+    throw std::bad_alloc();
+  }
+}
+
+void DBus::PendingCall::cancel()
+{
+  if (Replay) Replay->Notify = nullptr;
+  if (Pending == nullptr) return;
+
+  dbus_pending_call_set_notify(Pending, nullptr, nullptr, nullptr);
+  if (!ready()) dbus_pending_call_cancel(Pending);
+}
+
 DBus::PendingCall::~PendingCall()
 {
   if (Pending) {
@@ -373,12 +570,196 @@ DBus::PendingCall::~PendingCall()
 }
 
 constexpr char const * const Bluepairy::AgentPath;
+constexpr std::size_t Bluepairy::Snapshot::ChunkSize;
+constexpr char const * const Bluepairy::MatchRule;
+
+class Bluepairy::IOThread {
+public:
+  RingBuffer<BlueZ::Event, 256> Queue;
+  std::mutex Mutex;
+  std::condition_variable Ready;
+  std::atomic<bool> Stop{false};
+  std::atomic<std::size_t> MaxQueueDepth{0}, Overflows{0};
+  EventStats Stats;
+
+  // Owned by the I/O thread.
+  std::vector<BlueZ::Event> Events;
+  std::deque<BlueZ::Event> Backlog;
+  std::unordered_map<std::string, std::string> Names;
+  std::thread Thread;
+
+  void flush() {
+    bool Pushed = false;
+
+    while (!Backlog.empty() && Queue.push(std::move(Backlog.front()))) {
+      Backlog.pop_front();
+      Pushed = true;
+    }
+    if (!Backlog.empty()) Overflows.fetch_add(1, std::memory_order_relaxed);
+
+    auto Depth = Queue.size();
+    if (Depth > MaxQueueDepth.load(std::memory_order_relaxed)) {
+      MaxQueueDepth.store(Depth, std::memory_order_relaxed);
+    }
+
+    if (Pushed) {
+      { std::lock_guard<std::mutex> Lock(Mutex); }
+      Ready.notify_one();
+    }
+  }
+};
+
+class Bluepairy::StateSocket {
+  std::string Path;
+  int Listener;
+
+  struct Client {
+    int FD;
+    std::string Output;
+  };
+  std::vector<Client> Clients;
+
+  std::string Snapshot;
+  bool SnapshotValid = false;
+
+  // A client which does not keep up with the change stream is dropped.
+  static constexpr std::size_t MaxPendingOutput = 64 * 1024;
+
+  static void describe(std::ostream &Out, BlueZ::Adapter const &Adapter) {
+    Out << "adapter " << Adapter.path()
+        << " address=" << Adapter.address()
+        << " powered=" << Adapter.isPowered()
+        << " discovering=" << Adapter.isDiscovering()
+        << " name=" << oneLine(Adapter.name()) << '\n';
+  }
+
+  static void describe(std::ostream &Out, Bluepairy const &Pairy,
+                       DevicePtr const &Device) {
+    Out << "device " << Device->path()
+        << " adapter=" << (Device->adapter()? Device->adapter()->path() : "")
+        << " address=" << Device->address()
+        << " paired=" << Device->isPaired()
+        << " trusted=" << Device->isTrusted()
+        << " connected=" << Device->isConnected()
+        << " usable=" << Pairy.isUsable(Device)
+        << " name=" << oneLine(Device->name()) << '\n';
+  }
+
+  static std::string oneLine(std::string Text) {
+    replace(begin(Text), end(Text), '\n', ' ');
+    return Text;
+  }
+
+public:
+  std::set<std::string> Changed, Removed;
+
+  explicit StateSocket(std::string const &SocketPath) : Path(SocketPath) {
+    sockaddr_un Address{};
+
+    if (Path.size() >= sizeof(Address.sun_path)) {
+      throw std::runtime_error("State socket path is too long: " + Path);
+    }
+    Address.sun_family = AF_UNIX;
+    Path.copy(Address.sun_path, Path.size());
+
+    Listener = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (Listener == -1) {
+      throw std::system_error(errno, std::generic_category(), "socket");
+    }
+
+    unlink(Path.c_str());
+    if (bind(Listener, reinterpret_cast<sockaddr *>(&Address),
+             sizeof(Address)) == -1 ||
+        listen(Listener, 8) == -1) {
+      auto Error = errno;
+      close(Listener);
+      throw std::system_error(Error, std::generic_category(), Path);
+    }
+  }
+
+  ~StateSocket() {
+    for (auto &Client: Clients) close(Client.FD);
+    close(Listener);
+    unlink(Path.c_str());
+  }
+
+  void poll(Bluepairy const &Pairy) {
+    if (!Changed.empty() || !Removed.empty()) {
+      SnapshotValid = false;
+
+      if (!Clients.empty()) {
+        std::ostringstream Batch;
+
+        for (auto const &Path: Changed) {
+          if (auto Device = Pairy.findDevice(Path.c_str())) {
+            describe(Batch, Pairy, Device);
+          } else {
+            for (auto const &Adapter: Pairy.Adapters) {
+              if (Adapter->path() == Path) describe(Batch, *Adapter);
+            }
+          }
+        }
+        for (auto const &Path: Removed) Batch << "removed " << Path << '\n';
+        Batch << ".\n";
+
+        auto const Text = Batch.str();
+        for (auto &Client: Clients) Client.Output += Text;
+      }
+
+      Changed.clear();
+      Removed.clear();
+    }
+
+    int FD;
+    while ((FD = accept4(Listener, nullptr, nullptr,
+                         SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+      if (!SnapshotValid) {
+        std::ostringstream Out;
+
+        for (auto const &Adapter: Pairy.Adapters) describe(Out, *Adapter);
+        for (auto const &Device: Pairy.Devices) describe(Out, Pairy, Device);
+        Out << ".\n";
+        Snapshot = Out.str();
+        SnapshotValid = true;
+      }
+      Clients.push_back({FD, Snapshot});
+    }
+
+    for (auto Client = begin(Clients); Client != end(Clients);) {
+      bool Keep = true;
+      char Discard[256];
+      ssize_t Count;
+
+      while ((Count = recv(Client->FD, Discard, sizeof(Discard), 0)) > 0);
+      if (Count == 0 || (Count == -1 && errno != EAGAIN)) Keep = false;
+
+      while (Keep && !Client->Output.empty()) {
+        Count = ::send(Client->FD, Client->Output.data(), Client->Output.size(),
+                     MSG_NOSIGNAL);
+        if (Count > 0) {
+          Client->Output.erase(0, Count);
+        } else {
+          if (errno != EAGAIN) Keep = false;
+          break;
+        }
+      }
+      if (Client->Output.size() > MaxPendingOutput) Keep = false;
+
+      if (Keep) {
+        ++Client;
+      } else {
+        close(Client->FD);
+        Client = Clients.erase(Client);
+      }
+    }
+  }
+};
+
+constexpr std::size_t Bluepairy::StateSocket::MaxPendingOutput;
 
 Bluepairy::Bluepairy
 ( std::string const &Pattern, std::vector<std::string> UUIDs )
-: Pattern(Pattern)
-, ExpectedUUIDs(std::move(UUIDs))
-, SystemBus([]{
+: Bluepairy(Pattern, std::move(UUIDs), []{
     DBusError Error;
     dbus_error_init(&Error);
 
@@ -390,70 +771,166 @@ Bluepairy::Bluepairy
     }
 
     return Bus;
-  }())
-, Send([this]{
-    auto PreallocatedSend = dbus_connection_preallocate_send(SystemBus);
-    if (PreallocatedSend == nullptr) {
-      throw std::bad_alloc();
-    }
+  }(), true)
+{
+}
+
+Bluepairy::Bluepairy
+( std::string const &Pattern, std::vector<std::string> UUIDs
+, DBusConnection *Bus )
+: Bluepairy(Pattern, std::move(UUIDs), dbus_connection_ref(Bus), false)
+{
+}
 
-    return PreallocatedSend;
-  }())
+Bluepairy::Bluepairy
+( std::string const &Pattern, std::vector<std::string> UUIDs
+, DBusConnection *Bus, bool OwnsBus )
+: SystemBus(Bus, OwnsBus)
+, OwnsBus(OwnsBus)
+, Pattern(Pattern)
+, ExpectedUUIDs(std::move(UUIDs))
+, Send(nullptr)
+, Flight(new Flight::Recorder([this](std::uint32_t Row) {
+    return describeRow(Row);
+  }))
 {
   sort(begin(ExpectedUUIDs), end(ExpectedUUIDs));
 
-  DBusError Error;
+  // BlueZ is often not on the bus yet at boot.  The destructor does not
+  // run then, and the filter must not outlive this.
+  try {
+    connect();
+  } catch (...) {
+    disconnect();
+    throw;
+  }
+}
 
-  dbus_error_init(&Error);
-  dbus_bus_add_match(SystemBus, "type='signal',sender='org.bluez'", &Error);
-  throwIfErrorIsSet(Error);
+void Bluepairy::connect()
+{
+  Send = dbus_connection_preallocate_send(SystemBus);
+  if (Send == nullptr) {
+    throw std::bad_alloc();
+  }
 
-  readWrite();
+  if (dbus_connection_add_filter(SystemBus, filter, this, nullptr) == FALSE) {
+    throw std::bad_alloc();
+  }
+  Filtering = true;
 
-  { // Get managed objects
-    DBus::PendingCall PendingCall;
+  // These round trips are independent, so send them all before waiting
+  // for any reply.  The bus daemon handles our messages in order, so the
+  // match rule is in effect before BlueZ answers GetManagedObjects.
+  DBus::PendingCall AddMatch, GetManagedObjects, RegisterAgent;
 
-    PendingCall.send(SystemBus,
-                     BlueZ::newMethodCall
-                     ("/",
-                      DBus::ObjectManager::Interface, "GetManagedObjects"));
-    auto ManagedObjects = PendingCall.get();
+  {
+    auto Message = dbus_message_new_method_call
+      (DBUS_SERVICE_DBUS, DBUS_PATH_DBUS, DBUS_INTERFACE_DBUS, "AddMatch");
+    char const * const Rule = MatchRule;
 
-    DBusMessageIter Args;
-    if (!dbus_message_iter_init(ManagedObjects, &Args)) {
-      dbus_message_unref(ManagedObjects);
-      throw std::runtime_error("GetManagedObjects reply was empty");
+    if (Message == nullptr) {
+      throw std::bad_alloc();
+    }
+    if (dbus_message_append_args
+        (Message, DBUS_TYPE_STRING, &Rule, DBUS_TYPE_INVALID) == FALSE) {
+      dbus_message_unref(Message);
+      throw std::runtime_error("Failed to append arguments to AddMatch message");
     }
 
-    if (DBUS_TYPE_ARRAY != dbus_message_iter_get_arg_type(&Args)) {
-      dbus_message_unref(ManagedObjects);
+    AddMatch = call(std::move(Message));
+    Matching = true;
+  }
+  GetManagedObjects = call(BlueZ::newMethodCall
+                           ("/",
+                            DBus::ObjectManager::Interface, "GetManagedObjects"));
+  RegisterAgent = BlueZ::AgentManager(this).beginRegisterAgent
+    (AgentPath, "DisplayYesNo");
+  AgentRegistered = true;
+
+  dbus_message_unref(AddMatch.get());
+
+  {
+    auto ManagedObjects = GetManagedObjects.get();
+    auto const Loaded = loadManagedObjects(ManagedObjects);
+
+    dbus_message_unref(ManagedObjects);
+    if (!Loaded) {
       throw std::runtime_error
         ("Expected an array as first argument of GetManagedObjects reply");
     }
+  }
 
-    DBusMessageIter Objects;
+  dbus_message_unref(RegisterAgent.get());
+}
 
-    dbus_message_iter_recurse(&Args, &Objects);
-    while (DBUS_TYPE_DICT_ENTRY == dbus_message_iter_get_arg_type(&Objects)) {
-      DBusMessageIter Object;
-        
-      dbus_message_iter_recurse(&Objects, &Object);
-      updateObjectProperties(&Object);
+Bluepairy::Bluepairy
+( std::string const &Pattern, std::vector<std::string> UUIDs, Detached )
+: SystemBus(nullptr, false)
+, OwnsBus(false)
+, Pattern(Pattern)
+, ExpectedUUIDs(std::move(UUIDs))
+, Send(nullptr)
+, Flight(new Flight::Recorder([this](std::uint32_t Row) {
+    return describeRow(Row);
+  }))
+{
+  sort(begin(ExpectedUUIDs), end(ExpectedUUIDs));
+}
 
-      dbus_message_iter_next(&Objects);
-    }
-    dbus_message_unref(ManagedObjects);
+Bluepairy::~Bluepairy()
+{
+  if (IO) {
+    IO->Stop = true;
+    IO->Thread.join();
   }
 
-  auto AgentManager = BlueZ::AgentManager(this);
-  AgentManager.registerAgent(AgentPath, "DisplayYesNo");
+  State.reset();
+
+  if (SystemBus == nullptr) return;
+
+  for (auto const &Adapter: Adapters) Adapter->cancelOperations();
+  disconnect();
 }
 
-Bluepairy::~Bluepairy()
+void Bluepairy::disconnect()
 {
-  dbus_connection_free_preallocated_send(SystemBus, Send);
-  dbus_connection_close(SystemBus);
-  dbus_connection_unref(SystemBus);
+  if (!OwnsBus) {
+    auto unregister = [this](DBusMessage *Message) {
+      if (Message == nullptr) return;
+
+      dbus_message_set_no_reply(Message, TRUE);
+      dbus_connection_send(SystemBus, Message, nullptr);
+      dbus_message_unref(Message);
+    };
+    char const * const Path = AgentPath;
+    char const * const Rule = MatchRule;
+
+    if (AgentRegistered) {
+      auto Message = dbus_message_new_method_call
+        (BlueZ::Service, "/org/bluez", BlueZ::AgentManager::Interface,
+         "UnregisterAgent");
+      if (Message) {
+        dbus_message_append_args(Message, DBUS_TYPE_OBJECT_PATH, &Path,
+                                 DBUS_TYPE_INVALID);
+      }
+      unregister(Message);
+    }
+    if (Matching) {
+      auto Message = dbus_message_new_method_call
+        (DBUS_SERVICE_DBUS, DBUS_PATH_DBUS, DBUS_INTERFACE_DBUS, "RemoveMatch");
+      if (Message) {
+        dbus_message_append_args(Message, DBUS_TYPE_STRING, &Rule,
+                                 DBUS_TYPE_INVALID);
+      }
+      unregister(Message);
+    }
+  }
+  AgentRegistered = Matching = false;
+
+  if (Filtering) dbus_connection_remove_filter(SystemBus, filter, this);
+  Filtering = false;
+  if (Send) dbus_connection_free_preallocated_send(SystemBus, Send);
+  Send = nullptr;
 }
 
 bool BlueZ::Adapter::exists() const
@@ -464,71 +941,86 @@ bool BlueZ::Adapter::exists() const
          ) != end(Bluepairy->Adapters);
 }
 
+void BlueZ::Adapter::Changes::decode(DBusMessageIter &Properties /* {sa{sv}}... */)
+{
+  decodeProperties(Properties, *this, AdapterSchema);
+}
+
 void BlueZ::Adapter::onPropertiesChanged(DBusMessageIter &Properties /* {sa{sv}}... */)
 {
-  while (DBUS_TYPE_DICT_ENTRY == dbus_message_iter_get_arg_type(&Properties)) {
-    DBusMessageIter Property;
-    dbus_message_iter_recurse(&Properties, &Property);
-    if (DBUS_TYPE_STRING ==
-        dbus_message_iter_get_arg_type(&Property)) {
-      char const *PropertyName;
-      dbus_message_iter_get_basic(&Property, &PropertyName);
-      dbus_message_iter_next(&Property);
-      if (DBUS_TYPE_VARIANT == dbus_message_iter_get_arg_type(&Property)) {
-        DBusMessageIter Variant;
-        dbus_message_iter_recurse(&Property, &Variant);
-        if (strcmp(Property::Powered, PropertyName) == 0) {
-          if (DBUS_TYPE_BOOLEAN == dbus_message_iter_get_arg_type(&Variant)) {
-            dbus_bool_t BoolValue;
-            dbus_message_iter_get_basic(&Variant, &BoolValue);
-            Powered = BoolValue == TRUE;
-          }
-        } else if (strcmp(Property::Discovering, PropertyName) == 0) {
-          if (DBUS_TYPE_BOOLEAN == dbus_message_iter_get_arg_type(&Variant)) {
-            dbus_bool_t BoolValue;
-            dbus_message_iter_get_basic(&Variant, &BoolValue);
-            Discovering = BoolValue == TRUE;
-          }
-        } else if (strcmp(Property::Address, PropertyName) == 0) {
-          if (DBUS_TYPE_STRING == dbus_message_iter_get_arg_type(&Variant)) {
-            char const *StringValue;
-            dbus_message_iter_get_basic(&Variant, &StringValue);
-            Address = StringValue;
-          }
-        } else if (strcmp(Property::Name, PropertyName) == 0) {
-          if (DBUS_TYPE_STRING == dbus_message_iter_get_arg_type(&Variant)) {
-            char const *StringValue;
-            dbus_message_iter_get_basic(&Variant, &StringValue);
-            Name = StringValue;
-          }
-        }
-        assert(!dbus_message_iter_has_next(&Property));
-      }
+  Changes Changes;
+
+  Changes.decode(Properties);
+  update(Changes);
+}
+
+void BlueZ::Adapter::update(Changes const &Changes)
+{
+  if (Changes.Set & Changes::AddressBit) Address = Changes.Address;
+  if (Changes.Set & Changes::NameBit) Name = Changes.Name;
+  if (Changes.Set & Changes::PoweredBit) Powered = Changes.Powered;
+  if (Changes.Set & Changes::DiscoveringBit) Discovering = Changes.Discovering;
+}
+
+std::size_t BlueZ::Adapter::connectedDevices() const
+{
+  auto const &Table = *Bluepairy->Table;
+  std::size_t Count = 0;
+
+  for (DeviceTable::Row Row = 0; Row < Table.size(); ++Row) {
+    if (Table.Connected[Row] && Table.Live[Row] &&
+        Table.AdapterOf[Row].get() == this) {
+      Count += 1;
     }
-    dbus_message_iter_next(&Properties);
   }
+
+  return Count;
+}
+
+std::size_t BlueZ::Adapter::outstandingOperations() const
+{
+  Operations.erase(remove_if(begin(Operations), end(Operations),
+                             [](auto const &Call) { return Call.ready(); }),
+                   end(Operations));
+
+  return Operations.size();
+}
+
+void BlueZ::Adapter::track(DBus::PendingCall const &Operation) const
+{
+  outstandingOperations();
+  Operations.push_back(Operation);
+}
+
+void BlueZ::Adapter::cancelOperations() const
+{
+  for (auto &Operation: Operations) Operation.cancel();
+  Operations.clear();
+}
+
+DBus::PendingCall BlueZ::Adapter::setPowered(bool Value) const
+{
+  return Bluepairy->call(BlueZ::set(path(), Interface, Property::Powered, Value));
 }
 
 void BlueZ::Adapter::power(bool Value)
 {
-  DBus::PendingCall PendingCall;
+  dbus_message_unref(setPowered(Value).get());
+}
 
-  PendingCall.send(Bluepairy->SystemBus,
-                   BlueZ::set(path(), Interface, Property::Powered, Value));
-  dbus_message_unref(PendingCall.get());
+DBus::PendingCall BlueZ::Adapter::beginDiscovery() const
+{
+  return Bluepairy->call(BlueZ::newMethodCall
+                         (path(), Interface, "StartDiscovery"));
 }
 
 void BlueZ::Adapter::startDiscovery() const
 {
-  DBus::PendingCall PendingCall;
-
-  PendingCall.send(Bluepairy->SystemBus,
-                   BlueZ::newMethodCall
-                   (path(), Interface, "StartDiscovery"));
-  dbus_message_unref(PendingCall.get());
+  dbus_message_unref(beginDiscovery().get());
 }
 
-void BlueZ::Adapter::removeDevice(BlueZ::Device const *Device) const
+DBus::PendingCall
+BlueZ::Adapter::beginRemoveDevice(BlueZ::Device const *Device) const
 {
   auto RemoveDevice = BlueZ::newMethodCall
     (path(), Interface, "RemoveDevice");
@@ -542,114 +1034,251 @@ void BlueZ::Adapter::removeDevice(BlueZ::Device const *Device) const
       ("Failed to append arguments to RemoveDevice message");
   }
 
-  DBus::PendingCall PendingCall;
-  PendingCall.send(Bluepairy->SystemBus, std::move(RemoveDevice));
-  dbus_message_unref(PendingCall.get());
+  return Bluepairy->call(std::move(RemoveDevice));
 }
 
-bool BlueZ::Device::exists() const
+void BlueZ::Adapter::removeDevice(BlueZ::Device const *Device) const
 {
-  return find_if (
-	   begin(Bluepairy->Devices), end(Bluepairy->Devices),
-	   [this](auto Device) { return Device.get() == this; }
-         ) != end(Bluepairy->Devices);
+  dbus_message_unref(beginRemoveDevice(Device).get());
+}
+
+std::string BlueZ::Adapter::devicePath(std::string const &Address) const
+{
+  std::string Path = path() + "/dev_" + Address;
+
+  replace(begin(Path) + path().size(), end(Path), ':', '_');
+
+  return Path;
+}
+
+DBus::PendingCall
+BlueZ::Adapter::beginConnectDevice(std::string const &Address) const
+{
+  auto ConnectDevice = BlueZ::newMethodCall
+    (path(), Interface, "ConnectDevice");
+  DBusMessageIter Args, Properties, Entry, Variant;
+  char const *Key = Property::Address;
+  char const *Value = Address.c_str();
+
+  dbus_message_iter_init_append(ConnectDevice, &Args);
+  dbus_message_iter_open_container(&Args, DBUS_TYPE_ARRAY, "{sv}", &Properties);
+  dbus_message_iter_open_container(&Properties, DBUS_TYPE_DICT_ENTRY, nullptr,
+                                   &Entry);
+  dbus_message_iter_append_basic(&Entry, DBUS_TYPE_STRING, &Key);
+  dbus_message_iter_open_container(&Entry, DBUS_TYPE_VARIANT, "s", &Variant);
+  dbus_message_iter_append_basic(&Variant, DBUS_TYPE_STRING, &Value);
+  dbus_message_iter_close_container(&Entry, &Variant);
+  dbus_message_iter_close_container(&Properties, &Entry);
+  dbus_message_iter_close_container(&Args, &Properties);
+
+  return Bluepairy->call(std::move(ConnectDevice));
+}
+
+BlueZ::DeviceTable::Row BlueZ::DeviceTable::add()
+{
+  Row Row;
+
+  if (!Free.empty()) {
+    Row = Free.back();
+    Free.pop_back();
+  } else {
+    Row = size();
+    Live.emplace_back();
+    AdapterOf.emplace_back();
+    Address.emplace_back();
+    Name.emplace_back();
+    Modalias.emplace_back();
+    Connected.emplace_back();
+    Paired.emplace_back();
+    Trusted.emplace_back();
+    Blocked.emplace_back();
+    ServicesResolved.emplace_back();
+    RSSI.emplace_back();
+    Class.emplace_back();
+    Appearance.emplace_back();
+    UUIDs.emplace_back();
+    ManufacturerData.emplace_back();
+    LastSeen.emplace_back();
+    Changed.emplace_back();
+    Details.emplace_back();
+  }
+
+  Live[Row] = true;
+  AdapterOf[Row].reset();
+  Address[Row].clear();
+  Modalias[Row].clear();
+  Name[Row] = 0;
+  Connected[Row] = Paired[Row] = Trusted[Row] = false;
+  Blocked[Row] = ServicesResolved[Row] = false;
+  RSSI[Row] = Device::NoRSSI;
+  Class[Row] = 0;
+  Appearance[Row] = 0;
+  UUIDs[Row].clear();
+  ManufacturerData[Row].clear();
+  LastSeen[Row] = std::chrono::steady_clock::now();
+  Changed[Row] = 0;
+  Details[Row] = {};
+
+  return Row;
+}
+
+void BlueZ::DeviceTable::release(Row Row)
+{
+  Live[Row] = false;
+  AdapterOf[Row].reset();
+  Details[Row] = {};
+  releaseString(Name[Row]);
+  Name[Row] = 0;
+  Free.push_back(Row);
+}
+
+void BlueZ::DeviceTable::changed(Row Row, unsigned Bits)
+{
+  if (Changed[Row] == 0) ChangedRows.push_back(Row);
+  Changed[Row] |= Bits;
+}
+
+void BlueZ::DeviceTable::clearChanges()
+{
+  for (auto Row: ChangedRows) Changed[Row] = 0;
+  ChangedRows.clear();
+}
+
+BlueZ::DeviceTable::StringId BlueZ::DeviceTable::intern(std::string const &String)
+{
+  if (String.empty() && !Strings.empty()) return 0;
+
+  auto Pos = StringIds.find(String);
+  if (Pos != StringIds.end()) {
+    References[Pos->second] += 1;
+    return Pos->second;
+  }
+
+  StringId Id;
+  if (!FreeStrings.empty()) {
+    Id = FreeStrings.back();
+    FreeStrings.pop_back();
+    Strings[Id] = String;
+    References[Id] = 1;
+    NameMatches[Id] = 0;
+  } else {
+    Id = Strings.size();
+    Strings.push_back(String);
+    References.push_back(1);
+    NameMatches.push_back(0);
+  }
+  StringIds.emplace(String, Id);
+
+  return Id;
+}
+
+void BlueZ::DeviceTable::releaseString(StringId Id)
+{
+  if (Id == 0 || --References[Id] > 0) return;
+
+  StringIds.erase(Strings[Id]);
+  std::string().swap(Strings[Id]);
+  FreeStrings.push_back(Id);
+}
+
+void BlueZ::Device::Changes::decode(DBusMessageIter &Properties /* {sa{sv}}... */,
+                                    unsigned Mask)
+{
+  decodeProperties(Properties, *this, DeviceSchema, Mask);
+}
+
+void BlueZ::Device::decodeDetails() const
+{
+  auto &Details = Table->Details[Row];
+  auto Properties = Details.Properties;
+  Changes Changes;
+
+  Changes.decode(Properties, Details.Bits);
+  Details = {};
+  store(Changes);
 }
 
 void BlueZ::Device::onPropertiesChanged(DBusMessageIter &Properties /* {sa{sv}}... */)
 {
-  while (DBUS_TYPE_DICT_ENTRY == dbus_message_iter_get_arg_type(&Properties)) {
-    DBusMessageIter Property;
-    dbus_message_iter_recurse(&Properties, &Property);
-    if (DBUS_TYPE_STRING == dbus_message_iter_get_arg_type(&Property)) {
-      char const *PropertyName;
-      dbus_message_iter_get_basic(&Property, &PropertyName);
-      dbus_message_iter_next(&Property);
-      if (DBUS_TYPE_VARIANT == dbus_message_iter_get_arg_type(&Property)) {
-        DBusMessageIter Value;
-        dbus_message_iter_recurse(&Property, &Value);
-        if (strcmp(Property::Name, PropertyName) == 0) {
-          if (DBUS_TYPE_STRING == dbus_message_iter_get_arg_type(&Value)) {
-            char const *StringValue;
-            dbus_message_iter_get_basic(&Value, &StringValue);
-            Name = StringValue;
-          }
-        } else if (strcmp(Property::Address, PropertyName) == 0) {
-          if (DBUS_TYPE_STRING == dbus_message_iter_get_arg_type(&Value)) {
-            char const *StringValue;
-            dbus_message_iter_get_basic(&Value, &StringValue);
-            Address = StringValue;
-          }
-        } else if (strcmp(Property::Paired, PropertyName) == 0) {
-          if (DBUS_TYPE_BOOLEAN == dbus_message_iter_get_arg_type(&Value)) {
-            dbus_bool_t BoolValue;
-            dbus_message_iter_get_basic(&Value, &BoolValue);
-            Paired = BoolValue == TRUE;
-          }
-        } else if (strcmp(Property::Trusted, PropertyName) == 0) {
-          if (DBUS_TYPE_BOOLEAN == dbus_message_iter_get_arg_type(&Value)) {
-            dbus_bool_t BoolValue;
-            dbus_message_iter_get_basic(&Value, &BoolValue);
-            Trusted = BoolValue == TRUE;
-          }
-        } else if (strcmp(Property::Connected, PropertyName) == 0) {
-          if (DBUS_TYPE_BOOLEAN == dbus_message_iter_get_arg_type(&Value)) {
-            dbus_bool_t BoolValue;
-            dbus_message_iter_get_basic(&Value, &BoolValue);
-            Connected = BoolValue == TRUE;
-          }
-        } else if (strcmp("UUIDs", PropertyName) == 0) {
-          if (DBUS_TYPE_ARRAY == dbus_message_iter_get_arg_type(&Value)) {
-            DBusMessageIter UUIDs;
+  Changes Changes;
 
-            dbus_message_iter_recurse(&Value, &UUIDs);
+  Changes.decode(Properties);
+  update(Changes);
+}
 
-            this->UUIDs.clear();
-            while (DBUS_TYPE_STRING == dbus_message_iter_get_arg_type(&UUIDs)) {
-              char const *UUID;
-              dbus_message_iter_get_basic(&UUIDs, &UUID);
+void BlueZ::Device::update(Changes const &Changes)
+{
+  auto &T = *Table;
 
-              this->UUIDs.insert(UUID);
-              dbus_message_iter_next(&UUIDs);
-            }
-          }
-        } else if (strcmp(Property::Adapter, PropertyName) == 0) {
-          if (DBUS_TYPE_OBJECT_PATH == dbus_message_iter_get_arg_type(&Value)) {
-            char const *ObjectPath;
-            dbus_message_iter_get_basic(&Value, &ObjectPath);
-            if (ObjectPath) {
-              AdapterPtr = Bluepairy->getAdapter(ObjectPath);
-            } else {
-              AdapterPtr.reset();
-            }
-          }
-        }
-        assert(!dbus_message_iter_has_next(&Property));
-      }
+  // Newer than what GetManagedObjects left behind.
+  if (T.Details[Row].Bits) {
+    T.Details[Row].Bits &= ~Changes.Set;
+    if (T.Details[Row].Bits == 0) T.Details[Row] = {};
+  }
+  store(Changes);
+  if (Changes.Set & Changes::AdapterBit) {
+    if (!Changes.Adapter.empty()) {
+      T.AdapterOf[Row] = Bluepairy->getAdapter(Changes.Adapter.c_str());
+    } else {
+      T.AdapterOf[Row].reset();
     }
-    dbus_message_iter_next(&Properties);
   }
+  T.changed(Row, Changes.Set);
 }
 
-void BlueZ::Device::trust(bool Value)
+void BlueZ::Device::store(Changes const &Changes) const
 {
-  DBus::PendingCall PendingCall;
+  auto &T = *Table;
+
+  if (Changes.Set & Changes::NameBit) {
+    auto const Name = T.intern(Changes.Name);
+    T.releaseString(T.Name[Row]);
+    T.Name[Row] = Name;
+  }
+  if (Changes.Set & Changes::AddressBit) T.Address[Row] = Changes.Address;
+  if (Changes.Set & Changes::PairedBit) T.Paired[Row] = Changes.Paired;
+  if (Changes.Set & Changes::TrustedBit) T.Trusted[Row] = Changes.Trusted;
+  if (Changes.Set & Changes::ConnectedBit) T.Connected[Row] = Changes.Connected;
+  if (Changes.Set & Changes::BlockedBit) T.Blocked[Row] = Changes.Blocked;
+  if (Changes.Set & Changes::ServicesResolvedBit) {
+    T.ServicesResolved[Row] = Changes.ServicesResolved;
+  }
+  if (Changes.Set & Changes::RSSIBit) T.RSSI[Row] = Changes.RSSI;
+  if (Changes.Set & Changes::UUIDsBit) T.UUIDs[Row] = Changes.UUIDs;
+  if (Changes.Set & Changes::ClassBit) T.Class[Row] = Changes.Class;
+  if (Changes.Set & Changes::AppearanceBit) {
+    T.Appearance[Row] = Changes.Appearance;
+  }
+  if (Changes.Set & Changes::ManufacturerDataBit) {
+    T.ManufacturerData[Row] = Changes.ManufacturerData;
+  }
+  if (Changes.Set & Changes::ModaliasBit) T.Modalias[Row] = Changes.Modalias;
+}
+
+DBus::PendingCall BlueZ::Device::setTrusted(bool Value) const
+{
+  auto Call = Bluepairy->call(BlueZ::set(path(), Interface, Property::Trusted, Value));
+
+  if (auto Adapter = adapter()) Adapter->track(Call);
+
+  return Call;
+}
 
-  PendingCall.send(Bluepairy->SystemBus,
-                   BlueZ::set(path(), Interface, Property::Trusted, Value));
-  dbus_message_unref(PendingCall.get());
+void BlueZ::Device::trust(bool Value)
+{
+  dbus_message_unref(setTrusted(Value).get());
 }
 
 DBus::PendingCall BlueZ::Device::pair() const
 {
-  DBus::PendingCall Pending;
+  auto Call = Bluepairy->call(BlueZ::newMethodCall(path(), Interface, "Pair"));
 
-  Pending.send(Bluepairy->SystemBus,
-               BlueZ::newMethodCall(path(), Interface, "Pair"));
+  if (auto Adapter = adapter()) Adapter->track(Call);
 
-  return Pending;
+  return Call;
 }
 
-void BlueZ::Device::connectProfile(std::string UUID) const
+DBus::PendingCall BlueZ::Device::beginConnectProfile(std::string UUID) const
 {
   auto ConnectProfile = BlueZ::newMethodCall(path(), Interface, "ConnectProfile");
 
@@ -662,15 +1291,113 @@ void BlueZ::Device::connectProfile(std::string UUID) const
       ("Failed to append arguments to ConnectProfile message");
   }
 
-  DBus::PendingCall PendingCall;
-  PendingCall.send(Bluepairy->SystemBus, std::move(ConnectProfile));
-  dbus_message_unref(PendingCall.get());
+  auto Call = Bluepairy->call(std::move(ConnectProfile));
+
+  if (auto Adapter = adapter()) Adapter->track(Call);
+
+  return Call;
+}
+
+void BlueZ::Device::connectProfile(std::string UUID) const
+{
+  dbus_message_unref(beginConnectProfile(std::move(UUID)).get());
 }
 
 void Bluepairy::send(DBusMessage *&&Message) const
 {
-  dbus_connection_send_preallocated(SystemBus, Send, Message, nullptr);
+  if (SystemBus == nullptr) {
+    dbus_message_unref(Message);
+    return;
+  }
+
+  // Sending consumes the preallocation, so reserve one for the next reply.
+  if (Send) {
+    dbus_connection_send_preallocated(SystemBus, Send, Message, nullptr);
+  } else {
+    dbus_connection_send(SystemBus, Message, nullptr);
+  }
+  // Only sending assigns the serial, so record afterwards.
+  if (Recorder) Recorder->write(Trace::Direction::Sent, Message);
   dbus_message_unref(Message);
+  Send = dbus_connection_preallocate_send(SystemBus);
+}
+
+DBus::PendingCall Bluepairy::call(DBusMessage *&&Message) const
+{
+  DBus::PendingCall PendingCall;
+
+  if (SystemBus == nullptr) {
+    PendingCall = DBus::PendingCall(claim(Message));
+    Flight->record(Flight::Producer::Main, Flight::Kind::CallSent,
+                   std::chrono::steady_clock::now(), Flight::NoRow,
+                   Flight->intern(dbus_message_get_path(Message)),
+                   Flight->intern(dbus_message_get_member(Message)), 0);
+    PendingCall.recordTo(Flight.get(), 0);
+    dbus_message_unref(Message);
+
+    return PendingCall;
+  }
+
+  auto Sent = dbus_message_ref(Message);
+  PendingCall.send(SystemBus, std::move(Message));
+  auto const Serial = dbus_message_get_serial(Sent);
+  Flight->record(Flight::Producer::Main, Flight::Kind::CallSent,
+                 std::chrono::steady_clock::now(), Flight::NoRow,
+                 Flight->intern(dbus_message_get_path(Sent)),
+                 Flight->intern(dbus_message_get_member(Sent)), Serial);
+  PendingCall.recordTo(Flight.get(), Serial);
+  if (Recorder) {
+    Recorder->write(Trace::Direction::Sent, Sent);
+    PendingCall.traceTo(Recorder.get());
+  }
+  dbus_message_unref(Sent);
+
+  return PendingCall;
+}
+
+std::shared_ptr<DBus::PendingCall::Replayed>
+Bluepairy::claim(DBusMessage *Call) const
+{
+  std::string const Path = dbus_message_get_path(Call);
+  std::string const Member = dbus_message_get_member(Call);
+  auto Same = [&Path, &Member](Expectation const &Recorded) {
+    return Recorded.Path == Path && Recorded.Member == Member;
+  };
+
+  auto Pos = find_if(begin(Unclaimed), end(Unclaimed), Same);
+  if (Pos != end(Unclaimed)) {
+    auto Outcome = std::move(Pos->Outcome);
+    Unclaimed.erase(Pos);
+    return Outcome;
+  }
+
+  Unmatched.push_back({Path, Member,
+                       std::make_shared<DBus::PendingCall::Replayed>()});
+  return Unmatched.back().Outcome;
+}
+
+void Bluepairy::expect(DBusMessage *Call)
+{
+  if (dbus_message_get_type(Call) != DBUS_MESSAGE_TYPE_METHOD_CALL) return;
+  // The reply goes into the model directly, see replay().
+  if (strcmp(dbus_message_get_member(Call), "GetManagedObjects") == 0) return;
+
+  std::string const Path = dbus_message_get_path(Call);
+  std::string const Member = dbus_message_get_member(Call);
+  auto Same = [&Path, &Member](Expectation const &Made) {
+    return Made.Path == Path && Made.Member == Member;
+  };
+  std::shared_ptr<DBus::PendingCall::Replayed> Outcome;
+
+  auto Pos = find_if(begin(Unmatched), end(Unmatched), Same);
+  if (Pos != end(Unmatched)) {
+    Outcome = std::move(Pos->Outcome);
+    Unmatched.erase(Pos);
+  } else {
+    Outcome = std::make_shared<DBus::PendingCall::Replayed>();
+    Unclaimed.push_back({Path, Member, Outcome});
+  }
+  Replies[dbus_message_get_serial(Call)] = std::move(Outcome);
 }
   
 Bluepairy::AdapterPtr Bluepairy::getAdapter(char const *Path)
@@ -694,34 +1421,86 @@ void Bluepairy::removeAdapter(char const *Path)
   }
 }
 
+std::string Bluepairy::describeRow(BlueZ::DeviceTable::Row Row) const
+{
+  if (Row < ByRow.size() && ByRow[Row]) {
+    return ByRow[Row]->path() + ' ' + ByRow[Row]->name();
+  }
+
+  return "removed device";
+}
+
+Bluepairy::DevicePtr Bluepairy::findDevice(char const *Path) const
+{
+  auto Pos = ByPath.find(Path);
+
+  return Pos != ByPath.end()? Pos->second : nullptr;
+}
+
+void Bluepairy::targetAddress(std::string Address)
+{
+  static std::regex const Format("([[:xdigit:]]{2}:){5}[[:xdigit:]]{2}");
+
+  if (!Address.empty() && !regex_match(Address, Format)) {
+    throw std::invalid_argument("Invalid Bluetooth address: " + Address);
+  }
+
+  transform(begin(Address), end(Address), begin(Address),
+            [](unsigned char C) { return std::toupper(C); });
+  TargetAddress = std::move(Address);
+  outdate();
+}
+
+std::vector<Bluepairy::DevicePtr> Bluepairy::targetDevices() const
+{
+  std::vector<DevicePtr> Result;
+
+  for (auto const &Adapter: poweredAdapters()) {
+    auto Path = Adapter->devicePath(TargetAddress);
+    if (auto Device = findDevice(Path.c_str())) Result.push_back(Device);
+  }
+
+  return Result;
+}
+
 Bluepairy::DevicePtr Bluepairy::getDevice(char const *Path)
 {
-  auto EqualPath = [Path](auto O) { return O->path() == Path; };
-  auto Pos = find_if(begin(Devices), end(Devices), EqualPath);
-  if (Pos != end(Devices)) return *Pos;
-      
-  Devices.push_back(std::make_shared<BlueZ::Device>(Path, this));
+  if (auto Device = findDevice(Path)) return Device;
+
+  auto Device = std::make_shared<BlueZ::Device>(Path, this, Table);
+  if (ByRow.size() <= Device->row()) ByRow.resize(Device->row() + 1);
+  ByRow[Device->row()] = Device;
+  ByPath.emplace(Device->path(), Device);
+  Devices.push_back(Device);
+  outdate(Device->row());
 
-  return Devices.back();
+  return Device;
 }
 
 void Bluepairy::removeDevice(char const *Path)
 {
-  auto EqualPath = [Path](auto O) { return O->path() == Path; };
-  auto Pos = find_if(begin(Devices), end(Devices), EqualPath);
-  if (Pos != end(Devices)) {
-    Devices.erase(Pos);
+  auto Pos = ByPath.find(Path);
+  if (Pos != ByPath.end()) {
+    auto Device = std::move(Pos->second);
+
+    ByPath.erase(Pos);
+    ByRow[Device->row()].reset();
+    Table->Live[Device->row()] = false;
+    Devices.erase(find(begin(Devices), end(Devices), Device));
+    outdate(Device->row());
   } else {
     std::clog << "WARNING: Tried to remove device we never knew about." << std::endl;
   }
 }
 
-void Bluepairy::updateObjectProperties(DBusMessageIter *Object /* oa{sa{sv}} */)
+void Bluepairy::decodeObjectProperties(DBusMessageIter *Object /* oa{sa{sv}} */,
+                                       std::vector<BlueZ::Event> &Events)
 {
   if (DBUS_TYPE_OBJECT_PATH == dbus_message_iter_get_arg_type(Object)) {
     char const *Path;
 
     dbus_message_iter_get_basic(Object, &Path);
+    if (BlueZ::isBelowDevice(Path)) return;
     dbus_message_iter_next(Object);
     if (DBUS_TYPE_ARRAY == dbus_message_iter_get_arg_type(Object)) {
       DBusMessageIter Interfaces;
@@ -744,7 +1523,10 @@ void Bluepairy::updateObjectProperties(DBusMessageIter *Object /* oa{sa{sv}} */)
               DBusMessageIter Properties;
 
               dbus_message_iter_recurse(&Interface, &Properties);
-              getAdapter(Path)->onPropertiesChanged(Properties);
+              Events.emplace_back();
+              Events.back().What = BlueZ::Event::Kind::AdapterChanged;
+              Events.back().Path = Path;
+              Events.back().AdapterChanges.decode(Properties);
 
               assert(dbus_message_iter_has_next(&Interface) == FALSE);
             }
@@ -754,7 +1536,10 @@ void Bluepairy::updateObjectProperties(DBusMessageIter *Object /* oa{sa{sv}} */)
                 dbus_message_iter_get_arg_type(&Interface)) {
               DBusMessageIter Properties;
               dbus_message_iter_recurse(&Interface, &Properties);
-              getDevice(Path)->onPropertiesChanged(Properties);
+              Events.emplace_back();
+              Events.back().What = BlueZ::Event::Kind::DeviceChanged;
+              Events.back().Path = Path;
+              Events.back().DeviceChanges.decode(Properties);
               assert(dbus_message_iter_has_next(&Interface) == FALSE);
             }
           }
@@ -766,212 +1551,879 @@ void Bluepairy::updateObjectProperties(DBusMessageIter *Object /* oa{sa{sv}} */)
   }
 }
 
-void Bluepairy::readWrite()
+// Decodes objects one at a time into the same Event, without looking
+// into anything below devices.  Devices which cannot be the target keep
+// their Changes::DetailBits in the reply until they are needed.
+bool Bluepairy::loadManagedObjects(DBusMessage *Reply /* a{oa{sa{sv}}} */)
 {
-  DBusMessage *Incoming;
+  DBusMessageIter Args;
 
-  dbus_connection_read_write(SystemBus, 10);
+  if (dbus_message_iter_init(Reply, &Args) == FALSE ||
+      DBUS_TYPE_ARRAY != dbus_message_iter_get_arg_type(&Args) ||
+      DBUS_TYPE_DICT_ENTRY != dbus_message_iter_get_element_type(&Args)) {
+    return false;
+  }
 
-  while ((Incoming = dbus_connection_pop_message(SystemBus))) {
-    char const *Path = dbus_message_get_path(Incoming);
+  using DeviceChanges = BlueZ::Device::Changes;
+  auto const Received = std::chrono::steady_clock::now();
+  std::shared_ptr<DBusMessage> Message;
+  BlueZ::Event Event;
+  DBusMessageIter Objects;
+
+  Event.Received = Received;
+  dbus_message_iter_recurse(&Args, &Objects);
+  for (; DBUS_TYPE_DICT_ENTRY == dbus_message_iter_get_arg_type(&Objects);
+       dbus_message_iter_next(&Objects)) {
+    DBusMessageIter Object, Interfaces;
+    char const *Path;
 
-    switch (dbus_message_get_type(Incoming)) {
-    case DBUS_MESSAGE_TYPE_ERROR: {
-      DBusError Error;
-      dbus_error_init(&Error);
-      if (dbus_set_error_from_message(&Error, Incoming)) {
-        dbus_message_unref(Incoming);
-        throwIfErrorIsSet(Error);
+    dbus_message_iter_recurse(&Objects, &Object);
+    if (DBUS_TYPE_OBJECT_PATH != dbus_message_iter_get_arg_type(&Object)) {
+      continue;
+    }
+    dbus_message_iter_get_basic(&Object, &Path);
+    if (BlueZ::isBelowDevice(Path)) continue;
+    dbus_message_iter_next(&Object);
+    if (DBUS_TYPE_ARRAY != dbus_message_iter_get_arg_type(&Object)) continue;
+
+    dbus_message_iter_recurse(&Object, &Interfaces);
+    for (; DBUS_TYPE_DICT_ENTRY == dbus_message_iter_get_arg_type(&Interfaces);
+         dbus_message_iter_next(&Interfaces)) {
+      DBusMessageIter Interface, Properties;
+      char const *InterfaceName;
+
+      dbus_message_iter_recurse(&Interfaces, &Interface);
+      if (DBUS_TYPE_STRING != dbus_message_iter_get_arg_type(&Interface)) {
+        continue;
+      }
+      dbus_message_iter_get_basic(&Interface, &InterfaceName);
+      dbus_message_iter_next(&Interface);
+      if (DBUS_TYPE_ARRAY != dbus_message_iter_get_arg_type(&Interface)) {
+        continue;
+      }
+      dbus_message_iter_recurse(&Interface, &Properties);
+
+      if (strcmp(BlueZ::Adapter::Interface, InterfaceName) == 0) {
+        Event.What = BlueZ::Event::Kind::AdapterChanged;
+        Event.Path = Path;
+        Event.AdapterChanges.Set = 0;
+        Event.AdapterChanges.decode(Properties);
+        apply(Event);
+      } else if (strcmp(BlueZ::Device::Interface, InterfaceName) == 0) {
+        auto const Details = Properties;
+        auto &Changes = Event.DeviceChanges;
+        BlueZ::Postponed<DeviceChanges> Later;
+
+        Changes.Set = 0;
+        BlueZ::decodeProperties(Properties, Changes, BlueZ::DeviceSchema,
+                                ~DeviceChanges::DetailBits, &Later);
+        // Held until apply() stored it, which keeps the match cached.
+        auto const Name =
+          TargetAddress.empty() && Changes.Set & DeviceChanges::NameBit
+          ? Table->intern(Changes.Name) : 0;
+        bool const Candidate =
+          !TargetAddress.empty()
+          ? !(Changes.Set & DeviceChanges::AddressBit) ||
+            Changes.Address == TargetAddress
+          : Name == 0 || nameMatches(Name);
+        if (Candidate) Later.decode(Changes);
+        Event.What = BlueZ::Event::Kind::DeviceChanged;
+        Event.Path = Path;
+        apply(Event);
+        Table->releaseString(Name);
+
+        if (!Candidate) {
+          if (!Message) {
+            Message.reset(dbus_message_ref(Reply), dbus_message_unref);
+          }
+          auto Device = findDevice(Path);
+          Table->Details[Device->row()] = {
+            Message, Details, DeviceChanges::DetailBits
+          };
+        }
       }
-      break;
     }
+  }
 
-    case DBUS_MESSAGE_TYPE_METHOD_RETURN: {
-      break;
-    }
+  return true;
+}
 
-    case DBUS_MESSAGE_TYPE_METHOD_CALL:
-      if (dbus_message_has_path(Incoming, AgentPath)) {
-        if (dbus_message_is_method_call
-            (Incoming, BlueZ::Agent::Interface, "RequestPinCode") == TRUE) {
-          DBusMessageIter Args;
-
-          dbus_message_iter_init(Incoming, &Args);
-          if (DBUS_TYPE_OBJECT_PATH == dbus_message_iter_get_arg_type(&Args)) {
-            char const *Path;
-
-            dbus_message_iter_get_basic(&Args, &Path);
-            auto Device = getDevice(Path);
-            DBusMessage *Reply = dbus_message_new_method_return(Incoming);
-            if (Reply != nullptr) {
-              auto PIN = guessPIN(Device);
-              char const * const StringValue = PIN.c_str();
-              dbus_message_append_args(
-                Reply,
-                DBUS_TYPE_STRING, &StringValue,
-                DBUS_TYPE_INVALID
-              );
-              send(std::move(Reply));
-              std::clog << "RequestPinCode for " << Device->name()
-                        << " answered with " << PIN << std::endl;
-            }
-          }
-        } else if (dbus_message_is_method_call
-                   (Incoming, BlueZ::Agent::Interface, "RequestConfirmation")
-                   == TRUE) {
-          char const *Path;
-          dbus_uint32_t PassKey;
-          DBusError Error;
-          dbus_error_init(&Error);
-          if (dbus_message_get_args
-              (Incoming, &Error,
-               DBUS_TYPE_OBJECT_PATH, &Path,
-               DBUS_TYPE_UINT32, &PassKey,
-               DBUS_TYPE_INVALID) == FALSE) {
-            throw std::runtime_error
-              ("Failed to get arguments of RequestConfirmation message");
-          }
-          throwIfErrorIsSet(Error);
-          
-          { // A void reply indicates that we confirm.
-            DBusMessage *Reply = dbus_message_new_method_return(Incoming);
-            if (Reply == nullptr) {
-              throw std::bad_alloc();
-            }
-            send(std::move(Reply));
+void Bluepairy::apply(BlueZ::Event &Event)
+{
+  if (State) {
+    switch (Event.What) {
+    case BlueZ::Event::Kind::AdapterChanged:
+      // Usability of its devices depends on whether the adapter is powered.
+      if (Event.AdapterChanges.Set & BlueZ::Adapter::Changes::PoweredBit) {
+        auto const Adapter = getAdapter(Event.Path.c_str()).get();
+        auto const &T = *Table;
+
+        for (BlueZ::DeviceTable::Row Row = 0; Row < T.size(); ++Row) {
+          if (T.Live[Row] && T.AdapterOf[Row].get() == Adapter) {
+            State->Changed.insert(ByRow[Row]->path());
           }
-          std::clog << "RequestConfirmation confirmed" << std::endl;
         }
       }
-      std::clog << "Method call "
-                << dbus_message_get_path(Incoming) << " "
-                << dbus_message_get_interface(Incoming) << " "
-                << dbus_message_get_member(Incoming)
-                << std::endl;
+      // Fall through.
+    case BlueZ::Event::Kind::DeviceChanged:
+      // The RSSI is not part of the state.
+      if (Event.DeviceChanges.Set & ~BlueZ::Device::Changes::RSSIBit ||
+          !findDevice(Event.Path.c_str())) {
+        State->Changed.insert(Event.Path);
+        State->Removed.erase(Event.Path);
+      }
       break;
+    case BlueZ::Event::Kind::AdapterRemoved:
+    case BlueZ::Event::Kind::DeviceRemoved:
+      State->Changed.erase(Event.Path);
+      State->Removed.insert(Event.Path);
+      break;
+    case BlueZ::Event::Kind::Error:
+      break;
+    }
+  }
 
-    case DBUS_MESSAGE_TYPE_SIGNAL: {
-      bool handled = false;
-
-      if (dbus_message_is_signal
-          (Incoming, DBus::Properties::Interface, "PropertiesChanged")
-          == TRUE) {
-        DBusMessageIter Args;
-
-        dbus_message_iter_init(Incoming, &Args);
-        if (DBUS_TYPE_STRING == dbus_message_iter_get_arg_type(&Args)) {
-          char const *InterfaceName;
-
-          dbus_message_iter_get_basic(&Args, &InterfaceName);
-          dbus_message_iter_next(&Args);
-          if (DBUS_TYPE_ARRAY == dbus_message_iter_get_arg_type(&Args)) {
-            DBusMessageIter Properties;
-
-            dbus_message_iter_recurse(&Args, &Properties);
+  switch (Event.What) {
+  case BlueZ::Event::Kind::AdapterChanged: {
+    auto const Adapter = getAdapter(Event.Path.c_str());
 
-            if (strcmp(BlueZ::Adapter::Interface, InterfaceName) == 0) {
-              getAdapter(Path)->onPropertiesChanged(Properties);
-              handled = true;
-            } else if (strcmp(BlueZ::Device::Interface, InterfaceName) == 0) {
-              getDevice(Path)->onPropertiesChanged(Properties);
-              handled = true;
-            }
-          }
-        }
-      } else if (dbus_message_has_interface(Incoming, DBus::ObjectManager::Interface) == TRUE) {
-        if (dbus_message_has_member(Incoming, "InterfacesAdded") == TRUE) {
-          DBusMessageIter Args;
-          dbus_message_iter_init(Incoming, &Args);
+    Adapter->update(Event.AdapterChanges);
+    if (PublishSnapshots) {
+      SnapshotOutdated = true;
+      // Usability of its devices depends on whether it is powered.
+      if (Event.AdapterChanges.Set & BlueZ::Adapter::Changes::PoweredBit) {
+        auto const &T = *Table;
 
-          updateObjectProperties(&Args);
-          handled = true;
-        } else if (dbus_message_has_member(Incoming, "InterfacesRemoved") == TRUE) {
-          DBusMessageIter Args;
-          dbus_message_iter_init(Incoming, &Args);
-
-          if (DBUS_TYPE_OBJECT_PATH == dbus_message_iter_get_arg_type(&Args)) {
-            char const *Path;
-
-            dbus_message_iter_get_basic(&Args, &Path);
-            dbus_message_iter_next(&Args);
-            if (DBUS_TYPE_ARRAY == dbus_message_iter_get_arg_type(&Args)) {
-              DBusMessageIter Interfaces;
-
-              dbus_message_iter_recurse(&Args, &Interfaces);
-              while (DBUS_TYPE_STRING == dbus_message_iter_get_arg_type(&Interfaces)) {
-                char const *InterfaceName;
-
-                dbus_message_iter_get_basic(&Interfaces, &InterfaceName);
-                if (strcmp(BlueZ::Adapter::Interface, InterfaceName) == 0) {
-                  removeAdapter(Path);
-                } else if (strcmp(BlueZ::Device::Interface, InterfaceName) == 0) {
-                  removeDevice(Path);
-                }
-                dbus_message_iter_next(&Interfaces);
-              }
-              handled = true;
-            }
-          }
+        for (BlueZ::DeviceTable::Row Row = 0; Row < T.size(); ++Row) {
+          if (T.Live[Row] && T.AdapterOf[Row] == Adapter) outdate(Row);
         }
       }
-      if (!handled)
-        fprintf(stderr, "Unhandled signal %s.%s\n",
-                dbus_message_get_interface(Incoming),
-                dbus_message_get_member(Incoming));
-      break;
     }
+    break;
+  }
+  case BlueZ::Event::Kind::DeviceChanged: {
+    auto Device = getDevice(Event.Path.c_str());
+
+    Device->update(Event.DeviceChanges);
+    if (matches(Device)) {
+      Flight->record(Flight::Producer::Main, Flight::Kind::DeviceChanged,
+                     Event.Received, Device->row(), nullptr, nullptr,
+                     Event.DeviceChanges.Set);
+    }
+    if (Event.DeviceChanges.Set & BlueZ::Device::Changes::RSSIBit ||
+        Device->isConnected()) {
+      Device->seen(Event.Received);
     }
-    dbus_message_unref(Incoming);
+    break;
+  }
+  case BlueZ::Event::Kind::AdapterRemoved:
+    removeAdapter(Event.Path.c_str());
+    if (PublishSnapshots) SnapshotOutdated = true;
+    break;
+  case BlueZ::Event::Kind::DeviceRemoved:
+    removeDevice(Event.Path.c_str());
+    break;
+  case BlueZ::Event::Kind::Error:
+    if (Event.Path.empty()) throw std::runtime_error(Event.Message);
+
+    DBusError Error;
+    dbus_error_init(&Error);
+    dbus_set_error(&Error, Event.Path.c_str(), "%s", Event.Message.c_str());
+    throwIfErrorIsSet(Error);
+    break;
   }
 }
 
-bool Bluepairy::hasExpectedProfiles(DevicePtr Device) const
+void Bluepairy::updated()
+{
+  if (UpdateHandler) UpdateHandler();
+  if (PublishSnapshots) {
+    for (auto Row: Table->changedRows()) {
+      if (Table->Changed[Row] & ~BlueZ::Device::Changes::RSSIBit) {
+        outdate(Row);
+      } else if (Row < Published.size() && Published[Row]) {
+        Published[Row]->RSSI.store(Table->RSSI[Row], std::memory_order_relaxed);
+      }
+    }
+  }
+  Table->clearChanges();
+}
+
+void Bluepairy::publishSnapshots()
 {
-  std::vector<std::string> Intersection;
+  PublishSnapshots = true;
+  publish();
+}
 
-  std::set_intersection(begin(Device->profiles()), end(Device->profiles()),
-			begin(ExpectedUUIDs), end(ExpectedUUIDs),
-			std::back_inserter(Intersection));
+void Bluepairy::outdate(BlueZ::DeviceTable::Row Row)
+{
+  if (!PublishSnapshots) return;
 
-  return Intersection == ExpectedUUIDs;
+  if (Row < Published.size()) Published[Row].reset();
+  auto const Chunk = Row / Snapshot::ChunkSize;
+  if (Chunk < PublishedChunks.size()) PublishedChunks[Chunk].reset();
+  SnapshotOutdated = true;
 }
 
-std::string Bluepairy::guessPIN(DevicePtr Device) const
+void Bluepairy::outdate()
 {
-  std::smatch Match;
-  std::regex HandyTech("(" "Actilino ALO"
-                       "|" "Active Braille AB4"
-                       "|" "Active Star AS4"
-                       "|" "Basic Braille BB4"
-                       "|" "Braille Star 40 BS4"
-                       "|" "Braillino BL2"
-                       ")"
-                       "/" "[[:upper:]][[:digit:]]"
-                       "-" "([[:digit:]]+)");
+  if (!PublishSnapshots) return;
 
-  if (regex_match(Device->name(), Match, HandyTech) && Match.size() == 3) {
-    std::string SerialNumber = Match[2];
+  Published.clear();
+  PublishedChunks.clear();
+  SnapshotOutdated = true;
+}
 
-    if (SerialNumber.size() == 5) {
-      std::stringstream PINCode;
+void Bluepairy::publish()
+{
+  auto const &T = *Table;
+  std::unique_ptr<Snapshot> Next(new Snapshot);
+
+  Next->Generation = ++Generation;
+  for (auto const &Adapter: Adapters) {
+    Next->Adapters.push_back({ Adapter->path(), Adapter->address(),
+                               Adapter->name(), Adapter->isPowered(),
+                               Adapter->isDiscovering() });
+  }
 
-      for (int I = 0; I < SerialNumber.size(); ++I) {
-	char Digit = ((SerialNumber[I] - '0' + I + 1) % 10) + '0';
-	PINCode << Digit;
+  // Only chunks with changed rows are built again.
+  auto const ChunkCount = (T.size() + Snapshot::ChunkSize - 1) /
+                          Snapshot::ChunkSize;
+  if (Published.size() < T.size()) Published.resize(T.size());
+  if (PublishedChunks.size() < ChunkCount) PublishedChunks.resize(ChunkCount);
+  Next->Chunks.reserve(ChunkCount);
+  for (std::size_t Index = 0; Index < ChunkCount; ++Index) {
+    auto &Entry = PublishedChunks[Index];
+
+    if (!Entry) {
+      std::shared_ptr<Snapshot::Chunk> Chunk(new Snapshot::Chunk);
+      auto const First = Index * Snapshot::ChunkSize;
+      auto const End = std::min(T.size(), First + Snapshot::ChunkSize);
+
+      for (auto Row = First; Row < End; ++Row) {
+        auto const &Device = ByRow[Row];
+        if (!T.Live[Row] || !Device) continue;
+
+        auto &Published = this->Published[Row];
+        if (!Published) {
+          auto const Adapter = Device->adapter();
+          Published.reset(new Snapshot::Device{
+            Device->path(), Adapter? Adapter->path() : std::string(),
+            Device->address(), Device->name(),
+            Device->isPaired(), Device->isTrusted(), Device->isConnected(),
+            Device->servicesResolved(), Device->isBlocked(), isUsable(Device),
+            {Device->rssi()}, Device->profiles()
+          });
+        }
+        (*Chunk)[Row - First] = Published;
       }
-
-      return PINCode.str();
+      Entry = std::move(Chunk);
     }
+    Next->Chunks.push_back(Entry);
   }
 
-  return "0000";
+  Snapshots.publish(std::move(Next));
+  SnapshotOutdated = false;
 }
 
-void Bluepairy::powerUpAllAdapters()
+void Bluepairy::serveState(std::string const &SocketPath)
 {
-  for (auto Adapter: Adapters) {
-    if (!Adapter->isPowered()) {
-      Adapter->power(true);
+  State.reset(new StateSocket(SocketPath));
+  State->poll(*this);
+}
+
+void Bluepairy::record(std::string const &TracePath)
+{
+  if (IO) {
+    throw std::logic_error("Recording has to start before the I/O thread");
+  }
+
+  Recorder.reset(new Trace::Writer(TracePath));
+
+  // A replay starts from what BlueZ knows right now.
+  auto ManagedObjects = call(BlueZ::newMethodCall
+                             ("/",
+                              DBus::ObjectManager::Interface,
+                              "GetManagedObjects")).get();
+  loadManagedObjects(ManagedObjects);
+  dbus_message_unref(ManagedObjects);
+}
+
+void Bluepairy::replay(DBusMessage *Message)
+{
+  auto const Type = dbus_message_get_type(Message);
+  auto const Pos = Type == DBUS_MESSAGE_TYPE_METHOD_RETURN ||
+                   Type == DBUS_MESSAGE_TYPE_ERROR
+                   ? Replies.find(dbus_message_get_reply_serial(Message))
+                   : Replies.end();
+
+  if (Pos != Replies.end()) {
+    auto Outcome = std::move(Pos->second);
+    Replies.erase(Pos);
+    Outcome->complete(Message);
+  } else if (Type == DBUS_MESSAGE_TYPE_METHOD_RETURN) {
+    if (loadManagedObjects(Message)) updated();
+  } else {
+    filter(SystemBus, Message, this);
+  }
+
+  process();
+}
+
+void Bluepairy::startIOThread()
+{
+  if (IO) return;
+  if (!OwnsBus) {
+    throw std::logic_error("A shared connection is dispatched by its owner");
+  }
+
+  dbus_threads_init_default();
+  IO.reset(new IOThread);
+  for (auto Device: Devices) IO->Names[Device->path()] = Device->name();
+
+  IO->Thread = std::thread([this] {
+    while (!IO->Stop.load(std::memory_order_relaxed)) {
+      dbus_connection_read_write(SystemBus, 10);
+
+      IO->Events.clear();
+      while (dbus_connection_dispatch(SystemBus) == DBUS_DISPATCH_DATA_REMAINS);
+
+      for (auto &Event: IO->Events) {
+        if (Event.What == BlueZ::Event::Kind::DeviceChanged &&
+            Event.DeviceChanges.Set & BlueZ::Device::Changes::NameBit) {
+          IO->Names[Event.Path] = Event.DeviceChanges.Name;
+        } else if (Event.What == BlueZ::Event::Kind::DeviceRemoved) {
+          IO->Names.erase(Event.Path);
+        }
+        IO->Backlog.push_back(std::move(Event));
+      }
+
+      if (!PINRequests.empty()) {
+        answerPINRequests([this](char const *Path) {
+          auto Pos = IO->Names.find(Path);
+          return Pos != IO->Names.end()? Pos->second : std::string();
+        });
+      }
+
+      IO->flush();
+    }
+  });
+}
+
+Bluepairy::EventStats Bluepairy::eventStats() const
+{
+  if (!IO) return {};
+
+  auto Stats = IO->Stats;
+  Stats.MaxQueueDepth = IO->MaxQueueDepth.load(std::memory_order_relaxed);
+  Stats.Overflows = IO->Overflows.load(std::memory_order_relaxed);
+
+  return Stats;
+}
+
+void Bluepairy::readWrite()
+{
+  if (IO) {
+    BlueZ::Event Event;
+    bool Applied = false;
+
+    if (IO->Queue.empty()) {
+      std::unique_lock<std::mutex> Lock(IO->Mutex);
+      IO->Ready.wait_for(Lock, std::chrono::milliseconds(10),
+                         [this] { return !IO->Queue.empty(); });
+    }
+
+    while (IO->Queue.pop(Event)) {
+      auto Latency = std::chrono::steady_clock::now() - Event.Received;
+
+      IO->Stats.Events += 1;
+      IO->Stats.TotalLatency += Latency;
+      if (Latency > IO->Stats.MaxLatency) IO->Stats.MaxLatency = Latency;
+
+      apply(Event);
+      Applied = true;
+    }
+    if (Applied) updated();
+
+    process();
+
+    return;
+  }
+
+  dbus_connection_read_write(SystemBus, 10);
+  while (dbus_connection_dispatch(SystemBus) == DBUS_DISPATCH_DATA_REMAINS);
+
+  process();
+}
+
+void Bluepairy::process()
+{
+  if (DeferredError) {
+    auto Error = DeferredError;
+    DeferredError = nullptr;
+    std::rethrow_exception(Error);
+  }
+
+  // The I/O thread takes care of them itself.
+  if (!IO && !PINRequests.empty()) {
+    answerPINRequests([this](char const *Path) {
+      auto Device = findDevice(Path);
+      return Device? Device->name() : std::string();
+    });
+  }
+  if (SnapshotOutdated) publish();
+  if (State) State->poll(*this);
+}
+
+DBusHandlerResult
+Bluepairy::filter(DBusConnection *, DBusMessage *Message, void *Data)
+{
+  auto Pairy = static_cast<Bluepairy *>(Data);
+  auto &Events = Pairy->IO? Pairy->IO->Events : Pairy->Decoded;
+  auto const First = Events.size();
+  bool Handled;
+
+  // Never let an exception unwind through libdbus.
+  try {
+    if (Pairy->Recorder) {
+      Pairy->Recorder->write(Trace::Direction::Received, Message);
+    }
+    if (Pairy->IO) {
+      Handled = Pairy->handleMessage(Message, [Pairy](char const *Path) {
+        auto Pos = Pairy->IO->Names.find(Path);
+        return Pos != Pairy->IO->Names.end()? Pos->second : std::string();
+      }, Events);
+    } else {
+      Handled = Pairy->handleMessage(Message, [Pairy](char const *Path) {
+        return Pairy->getDevice(Path)->name();
+      }, Events);
+    }
+  } catch (std::exception &E) {
+    Events.emplace_back();
+    Events.back().What = BlueZ::Event::Kind::Error;
+    Events.back().Message = E.what();
+    Handled = true;
+  }
+
+  auto const Received = std::chrono::steady_clock::now();
+  for (auto I = First; I < Events.size(); ++I) Events[I].Received = Received;
+
+  if (!Pairy->IO && !Events.empty()) {
+    try {
+      for (auto &Event: Events) Pairy->apply(Event);
+      Events.clear();
+      Pairy->updated();
+    } catch (...) {
+      Events.clear();
+      Pairy->DeferredError = std::current_exception();
+    }
+  }
+
+  // Signals may be of interest to other users of a shared connection.
+  if (dbus_message_get_type(Message) == DBUS_MESSAGE_TYPE_SIGNAL) {
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+  }
+
+  return Handled? DBUS_HANDLER_RESULT_HANDLED
+                : DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+}
+
+void Bluepairy::answerPIN(DBusMessage *Request, std::string const &Name) const
+{
+  DBusMessage *Reply = dbus_message_new_method_return(Request);
+  if (Reply == nullptr) return;
+
+  auto PIN = guessPIN(Name);
+  char const * const StringValue = PIN.c_str();
+  dbus_message_append_args(
+    Reply,
+    DBUS_TYPE_STRING, &StringValue,
+    DBUS_TYPE_INVALID
+  );
+  send(std::move(Reply));
+  std::clog << "RequestPinCode for " << Name
+            << " answered with " << PIN << std::endl;
+}
+
+void Bluepairy::answerPINRequests
+(std::function<std::string(char const *)> const &NameOf) const
+{
+  auto const Now = std::chrono::steady_clock::now();
+
+  for (auto Request = begin(PINRequests); Request != end(PINRequests);) {
+    auto const Name = NameOf(Request->Device.c_str());
+
+    if (!Name.empty()) {
+      answerPIN(Request->Message.get(), Name);
+    } else if (Now - Request->Received > std::chrono::seconds(10)) {
+      // Pairing then fails with AuthenticationCanceled and is retried soon.
+      auto Reply = dbus_message_new_error(Request->Message.get(),
+                                          "org.bluez.Error.Canceled",
+                                          "Name of the device is unknown");
+      if (Reply) send(std::move(Reply));
+      std::clog << "RequestPinCode for " << Request->Device
+                << " canceled, its name is unknown" << std::endl;
+    } else {
+      ++Request;
+      continue;
+    }
+    Request = PINRequests.erase(Request);
+  }
+}
+
+bool Bluepairy::handleMessage(DBusMessage *Incoming,
+                              std::function<std::string(char const *)> const &NameOf,
+                              std::vector<BlueZ::Event> &Events) const
+{
+  char const *Path = dbus_message_get_path(Incoming);
+  bool handled = false;
+
+  switch (dbus_message_get_type(Incoming)) {
+  case DBUS_MESSAGE_TYPE_ERROR: {
+    DBusError Error;
+    dbus_error_init(&Error);
+    if (dbus_set_error_from_message(&Error, Incoming)) {
+      Events.emplace_back();
+      Events.back().What = BlueZ::Event::Kind::Error;
+      Events.back().Path = Error.name;
+      Events.back().Message = Error.message;
+      dbus_error_free(&Error);
+      handled = true;
+    }
+    break;
+  }
+
+  case DBUS_MESSAGE_TYPE_METHOD_RETURN: {
+    break;
+  }
+
+  case DBUS_MESSAGE_TYPE_METHOD_CALL:
+    if (dbus_message_has_path(Incoming, AgentPath)) {
+      // Once there is an I/O thread, it is the only one dispatching.
+      auto const Producer = IO? Flight::Producer::IO : Flight::Producer::Main;
+
+      if (dbus_message_is_method_call
+          (Incoming, BlueZ::Agent::Interface, "RequestPinCode") == TRUE) {
+        DBusMessageIter Args;
+
+        dbus_message_iter_init(Incoming, &Args);
+        if (DBUS_TYPE_OBJECT_PATH == dbus_message_iter_get_arg_type(&Args)) {
+          char const *Path;
+
+          dbus_message_iter_get_basic(&Args, &Path);
+          Flight->record(Producer, Flight::Kind::AgentRequest,
+                         std::chrono::steady_clock::now(), Flight::NoRow,
+                         Flight->intern(Path), "RequestPinCode");
+          auto Name = NameOf(Path);
+          if (Name.empty()) {
+            PINRequests.push_back({
+              std::shared_ptr<DBusMessage>(dbus_message_ref(Incoming),
+                                           dbus_message_unref),
+              Path, std::chrono::steady_clock::now()
+            });
+            std::clog << "RequestPinCode for " << Path
+                      << " waits for its name" << std::endl;
+          } else {
+            answerPIN(Incoming, Name);
+          }
+          handled = true;
+        }
+      } else if (dbus_message_is_method_call
+                 (Incoming, BlueZ::Agent::Interface, "RequestConfirmation")
+                 == TRUE) {
+        char const *Path;
+        dbus_uint32_t PassKey;
+        DBusError Error;
+        dbus_error_init(&Error);
+        if (dbus_message_get_args
+            (Incoming, &Error,
+             DBUS_TYPE_OBJECT_PATH, &Path,
+             DBUS_TYPE_UINT32, &PassKey,
+             DBUS_TYPE_INVALID) == FALSE) {
+          throw std::runtime_error
+            ("Failed to get arguments of RequestConfirmation message");
+        }
+        throwIfErrorIsSet(Error);
+        Flight->record(Producer, Flight::Kind::AgentRequest,
+                       std::chrono::steady_clock::now(), Flight::NoRow,
+                       Flight->intern(Path), "RequestConfirmation", PassKey);
+
+        { // A void reply indicates that we confirm.
+          DBusMessage *Reply = dbus_message_new_method_return(Incoming);
+          if (Reply == nullptr) {
+            throw std::bad_alloc();
+          }
+          send(std::move(Reply));
+          handled = true;
+        }
+        std::clog << "RequestConfirmation confirmed" << std::endl;
+      }
+    }
+    std::clog << "Method call "
+              << dbus_message_get_path(Incoming) << " "
+              << dbus_message_get_interface(Incoming) << " "
+              << dbus_message_get_member(Incoming)
+              << std::endl;
+    break;
+
+  case DBUS_MESSAGE_TYPE_SIGNAL: {
+    if (dbus_message_is_signal
+        (Incoming, DBus::Properties::Interface, "PropertiesChanged")
+        == TRUE) {
+      DBusMessageIter Args;
+
+      dbus_message_iter_init(Incoming, &Args);
+      if (DBUS_TYPE_STRING == dbus_message_iter_get_arg_type(&Args)) {
+        char const *InterfaceName;
+
+        dbus_message_iter_get_basic(&Args, &InterfaceName);
+        dbus_message_iter_next(&Args);
+        if (DBUS_TYPE_ARRAY == dbus_message_iter_get_arg_type(&Args)) {
+          DBusMessageIter Properties;
+
+          dbus_message_iter_recurse(&Args, &Properties);
+
+          if (strcmp(BlueZ::Adapter::Interface, InterfaceName) == 0) {
+            Events.emplace_back();
+            Events.back().What = BlueZ::Event::Kind::AdapterChanged;
+            Events.back().Path = Path;
+            Events.back().AdapterChanges.decode(Properties);
+            handled = true;
+          } else if (strcmp(BlueZ::Device::Interface, InterfaceName) == 0) {
+            Events.emplace_back();
+            Events.back().What = BlueZ::Event::Kind::DeviceChanged;
+            Events.back().Path = Path;
+            Events.back().DeviceChanges.decode(Properties);
+            handled = true;
+          }
+        }
+      }
+    } else if (dbus_message_has_interface(Incoming, DBus::ObjectManager::Interface) == TRUE) {
+      if (dbus_message_has_member(Incoming, "InterfacesAdded") == TRUE) {
+        DBusMessageIter Args;
+        dbus_message_iter_init(Incoming, &Args);
+
+        decodeObjectProperties(&Args, Events);
+        handled = true;
+      } else if (dbus_message_has_member(Incoming, "InterfacesRemoved") == TRUE) {
+        DBusMessageIter Args;
+        dbus_message_iter_init(Incoming, &Args);
+
+        if (DBUS_TYPE_OBJECT_PATH == dbus_message_iter_get_arg_type(&Args)) {
+          char const *Path;
+
+          dbus_message_iter_get_basic(&Args, &Path);
+          dbus_message_iter_next(&Args);
+          if (DBUS_TYPE_ARRAY == dbus_message_iter_get_arg_type(&Args)) {
+            DBusMessageIter Interfaces;
+
+            dbus_message_iter_recurse(&Args, &Interfaces);
+            while (DBUS_TYPE_STRING == dbus_message_iter_get_arg_type(&Interfaces)) {
+              char const *InterfaceName;
+
+              dbus_message_iter_get_basic(&Interfaces, &InterfaceName);
+              if (strcmp(BlueZ::Adapter::Interface, InterfaceName) == 0) {
+                Events.emplace_back();
+                Events.back().What = BlueZ::Event::Kind::AdapterRemoved;
+                Events.back().Path = Path;
+              } else if (strcmp(BlueZ::Device::Interface, InterfaceName) == 0) {
+                Events.emplace_back();
+                Events.back().What = BlueZ::Event::Kind::DeviceRemoved;
+                Events.back().Path = Path;
+              }
+              dbus_message_iter_next(&Interfaces);
+            }
+            handled = true;
+          }
+        }
+      }
+    }
+    if (!handled && OwnsBus)
+      fprintf(stderr, "Unhandled signal %s.%s\n",
+              dbus_message_get_interface(Incoming),
+              dbus_message_get_member(Incoming));
+    break;
+  }
+  }
+
+  return handled;
+}
+
+bool Bluepairy::nameMatches(BlueZ::DeviceTable::StringId Name) const
+{
+  auto &Matches = Table->NameMatches[Name];
+
+  if (Matches == 0) {
+    Matches = regex_search(Table->string(Name), Pattern,
+                           std::regex_constants::match_not_null)
+              ? 2 : 1;
+  }
+
+  return Matches == 2;
+}
+
+bool Bluepairy::hasExpectedProfiles(DevicePtr Device) const
+{
+  return std::includes(begin(Device->profiles()), end(Device->profiles()),
+                       begin(ExpectedUUIDs), end(ExpectedUUIDs));
+}
+
+std::vector<Bluepairy::DevicePtr> Bluepairy::usableDevices() const
+{
+  auto const &T = *Table;
+  std::vector<DevicePtr> Result;
+
+  for (BlueZ::DeviceTable::Row Row = 0; Row < T.size(); ++Row) {
+    if (T.Paired[Row] && T.Live[Row] && T.AdapterOf[Row] &&
+        T.AdapterOf[Row]->isPowered() && isUsable(ByRow[Row])) {
+      Result.push_back(ByRow[Row]);
+    }
+  }
+
+  return Result;
+}
+
+std::vector<Bluepairy::DevicePtr> Bluepairy::pairableDevices() const
+{
+  auto const &T = *Table;
+  std::vector<DevicePtr> Result;
+
+  for (BlueZ::DeviceTable::Row Row = 0; Row < T.size(); ++Row) {
+    if (!T.Paired[Row] && T.Live[Row] && T.AdapterOf[Row] &&
+        T.AdapterOf[Row]->exists() && T.AdapterOf[Row]->isPowered() &&
+        matches(ByRow[Row]) &&
+        (!TargetAddress.empty() || PairFirst ||
+         hasExpectedProfiles(ByRow[Row]))) {
+      Result.push_back(ByRow[Row]);
+    }
+  }
+
+  return Result;
+}
+
+bool Bluepairy::hintsMatch(DevicePtr Device) const
+{
+  auto const &Hints = TargetHints;
+  if (Hints.empty()) return false;
+
+  // Major and minor device class.
+  std::uint32_t const ClassMask = 0x1FFC;
+  if (!Hints.Classes.empty() &&
+      none_of(begin(Hints.Classes), end(Hints.Classes),
+              [&Device, ClassMask](std::uint32_t Class) {
+                return Device->classOfDevice() != 0 &&
+                       (Device->classOfDevice() & ClassMask) == (Class & ClassMask);
+              })) {
+    return false;
+  }
+
+  if (!Hints.Appearances.empty() &&
+      find(begin(Hints.Appearances), end(Hints.Appearances),
+           Device->appearance()) == end(Hints.Appearances)) {
+    return false;
+  }
+
+  if (!Hints.Manufacturers.empty() &&
+      none_of(begin(Hints.Manufacturers), end(Hints.Manufacturers),
+              [&Device](Hints::Manufacturer const &Manufacturer) {
+                auto const &Data = Device->manufacturerData();
+                auto Entry = Data.find(Manufacturer.Company);
+
+                return Entry != Data.end() &&
+                       Entry->second.size() >= Manufacturer.Prefix.size() &&
+                       equal(begin(Manufacturer.Prefix), end(Manufacturer.Prefix),
+                             begin(Entry->second));
+              })) {
+    return false;
+  }
+
+  if (!Hints.UUIDs.empty() &&
+      none_of(begin(Hints.UUIDs), end(Hints.UUIDs),
+              [&Device](std::string const &UUID) {
+                return Device->profiles().count(UUID) > 0;
+              })) {
+    return false;
+  }
+
+  return true;
+}
+
+Bluepairy::DevicePtr
+Bluepairy::route(std::vector<DevicePtr> const &Objects) const
+{
+  DevicePtr Best;
+  std::size_t BestLoad = 0;
+
+  for (auto const &Device: Objects) {
+    auto Adapter = Device->adapter();
+    if (!Adapter || !Adapter->isPowered()) continue;
+
+    auto const Load = Adapter->connectedDevices() +
+                      Adapter->outstandingOperations();
+    if (!Best || Load < BestLoad ||
+        (Load == BestLoad && Device->rssi() > Best->rssi())) {
+      Best = Device;
+      BestLoad = Load;
+    }
+  }
+
+  return Best;
+}
+
+std::vector<Bluepairy::DevicePtr>
+Bluepairy::siblings(DevicePtr Device, std::vector<DevicePtr> const &Objects)
+{
+  std::vector<DevicePtr> Result;
+
+  copy_if(begin(Objects), end(Objects), back_inserter(Result),
+          [&Device](auto const &Other) {
+            return Other->address() == Device->address();
+          });
+
+  return Result;
+}
+
+std::string Bluepairy::guessPIN(DevicePtr Device) const
+{
+  return guessPIN(Device->name());
+}
+
+std::string Bluepairy::guessPIN(std::string const &Name)
+{
+  std::smatch Match;
+  std::regex HandyTech("(" "Actilino ALO"
+                       "|" "Active Braille AB4"
+                       "|" "Active Star AS4"
+                       "|" "Basic Braille BB4"
+                       "|" "Braille Star 40 BS4"
+                       "|" "Braillino BL2"
+                       ")"
+                       "/" "[[:upper:]][[:digit:]]"
+                       "-" "([[:digit:]]+)");
+
+  if (regex_match(Name, Match, HandyTech) && Match.size() == 3) {
+    std::string SerialNumber = Match[2];
+
+    if (SerialNumber.size() == 5) {
+      std::stringstream PINCode;
+
+      for (int I = 0; I < SerialNumber.size(); ++I) {
+	char Digit = ((SerialNumber[I] - '0' + I + 1) % 10) + '0';
+	PINCode << Digit;
+      }
+
+      return PINCode.str();
+    }
+  }
+
+  return "0000";
+}
+
+void Bluepairy::powerUpAllAdapters()
+{
+  for (auto Adapter: Adapters) {
+    if (!Adapter->isPowered()) {
+      Adapter->power(true);
       auto StartTime = std::chrono::steady_clock::now();
       do {
         readWrite();
@@ -1021,6 +2473,98 @@ void Bluepairy::forget(DevicePtr Device)
   }
 }
 
+std::vector<Bluepairy::DevicePtr>
+Bluepairy::stalePairings(std::chrono::steady_clock::duration Window) const
+{
+  auto const Now = std::chrono::steady_clock::now();
+  std::vector<DevicePtr> Matches, Stale;
+
+  copy_if(begin(Devices), end(Devices), back_inserter(Matches),
+          [this](auto const &Device) {
+            return Device->isPaired() && matches(Device);
+          });
+
+  auto Connected = [](auto const &Device) { return Device->isConnected(); };
+  auto Unseen = [Now, Window](auto const &Device) {
+    return !Device->isConnected() && Now - Device->lastSeen() > Window;
+  };
+
+  for (auto const &Device: Matches) {
+    auto Siblings = siblings(Device, Matches);
+
+    if (any_of(begin(Siblings), end(Siblings), Connected)) continue;
+
+    auto const Address = Device->address();
+    auto Other = [&Address](auto const &Match) {
+      return Match->address() != Address;
+    };
+    auto const Superseded = any_of(begin(Matches), end(Matches),
+                                   [&](auto const &Match) {
+                                     return Other(Match) && Connected(Match);
+                                   });
+    // Out of range alone is no reason to drop the only pairing left, it
+    // may just be switched off.
+    auto const Replaced = any_of(begin(Matches), end(Matches),
+                                 [&](auto const &Match) {
+                                   return Other(Match) && !Unseen(Match);
+                                 });
+    if (Superseded ||
+        (Replaced && all_of(begin(Siblings), end(Siblings), Unseen))) {
+      Stale.push_back(Device);
+    }
+  }
+
+  return Stale;
+}
+
+std::size_t
+Bluepairy::forget(std::vector<DevicePtr> const &Objects,
+                  std::chrono::steady_clock::duration Timeout)
+{
+  auto const Deadline = std::chrono::steady_clock::now() + Timeout;
+  struct Removal {
+    DevicePtr Device;
+    DBus::PendingCall Call;
+    bool Failed;
+  };
+  std::vector<Removal> Removals;
+
+  for (auto const &Device: Objects) {
+    if (Device->exists() && Device->adapter()) {
+      Removals.push_back({Device,
+                          Device->adapter()->beginRemoveDevice(Device.get()),
+                          false});
+    }
+  }
+
+  auto Gone = [](auto const &Removal) { return !Removal.Device->exists(); };
+  // A failed call is not going to remove its device.
+  auto Settled = [&Gone](auto const &Removal) {
+    return Removal.Failed || Gone(Removal);
+  };
+  auto collect = [](Removal &Removal) {
+    if (!Removal.Call || !Removal.Call.ready()) return;
+
+    try {
+      dbus_message_unref(Removal.Call.get());
+    } catch (std::exception &E) {
+      Removal.Failed = true;
+      std::clog << "Failed to remove " << Removal.Device->name()
+                << ": " << E.what() << std::endl;
+    }
+    Removal.Call = {};
+  };
+
+  for_each(begin(Removals), end(Removals), collect);
+  while (!all_of(begin(Removals), end(Removals), Settled) &&
+         std::chrono::steady_clock::now() < Deadline) {
+    readWrite();
+    for_each(begin(Removals), end(Removals), collect);
+  }
+
+  return count_if(begin(Removals), end(Removals), Gone);
+}
+
 void Bluepairy::pair(DevicePtr Device)
 {
   auto Future = Device->pair();
@@ -1051,3 +2595,508 @@ void Bluepairy::trust(DevicePtr Device)
     readWrite();
   } while (Device->exists() && !Device->isTrusted());
 }
+
+Pairing::Pairing(Bluepairy &Pairy, std::chrono::steady_clock::duration Timeout,
+                 std::ostream *Log)
+: Pairy(Pairy)
+, Log(Log)
+, Deadline(std::chrono::steady_clock::now() + Timeout)
+, Jitter(std::random_device{}())
+{
+}
+
+std::ostream &Pairing::log() const
+{
+  static std::ostream Null(nullptr);
+
+  return Log? *Log : Null;
+}
+
+void Pairing::logRoute() const
+{
+  auto Adapter = Device->adapter();
+
+  log() << "Using adapter " << Adapter->name() << " with "
+        << Adapter->connectedDevices() << " connected devices and "
+        << Adapter->outstandingOperations() << " outstanding operations"
+        << std::endl;
+}
+
+Pairing::~Pairing()
+{
+  for (auto &Call: Watched) Call.cancel();
+}
+
+DBus::PendingCall Pairing::watch(DBus::PendingCall Call)
+{
+  if (Wakeup) {
+    Watched.erase(remove_if(begin(Watched), end(Watched),
+                            [](auto const &Call) { return Call.ready(); }),
+                  end(Watched));
+    Call.notify(Wakeup);
+    Watched.push_back(Call);
+  }
+
+  return Call;
+}
+
+void Pairing::advance()
+{
+  if (finished()) return;
+
+  try {
+    if (!Started) {
+      Started = true;
+      enter(State::PoweringUp);
+    }
+    while (!finished() && step());
+  } catch (std::exception &E) {
+    fail(E.what());
+  }
+}
+
+void Pairing::fail(std::string Message)
+{
+  Error = std::move(Message);
+  AdapterCalls.clear();
+  Call = {};
+  enter(State::Failed);
+}
+
+namespace {
+  char const *nameOf(Pairing::State State) {
+    switch (State) {
+    case Pairing::State::PoweringUp: return "PoweringUp";
+    case Pairing::State::Searching: return "Searching";
+    case Pairing::State::Pairing: return "Pairing";
+    case Pairing::State::Resolving: return "Resolving";
+    case Pairing::State::Trusting: return "Trusting";
+    case Pairing::State::Connecting: return "Connecting";
+    case Pairing::State::Done: return "Done";
+    case Pairing::State::Failed: break;
+    }
+
+    return "Failed";
+  }
+} // namespace
+
+void Pairing::enter(State Next)
+{
+  Current = Next;
+  PhaseStart = std::chrono::steady_clock::now();
+
+  switch (Current) {
+  case State::PoweringUp:
+    for (auto Adapter: Pairy.adapters()) {
+      if (!Adapter->isPowered()) {
+        AdapterCalls.emplace_back(Adapter, watch(Adapter->setPowered(true)));
+      }
+    }
+    break;
+
+  case State::Pairing:
+    log() << "Trying to pair with "
+          << (Device->name().empty()? Device->address() : Device->name())
+          << std::endl;
+    PairingStart = PhaseStart;
+    ProfilesKnown = Pairy.hasExpectedProfiles(Device);
+    Call = watch(Device->pair());
+    break;
+
+  case State::Trusting:
+    Call = watch(Device->setTrusted(true));
+    break;
+
+  case State::Connecting: {
+    auto Usable = Pairy.usableDevices();
+
+    Profiles.clear();
+    // One physical device, possibly seen by several adapters.
+    if (!Usable.empty() &&
+        Bluepairy::siblings(Usable.front(), Usable).size() == Usable.size()) {
+      Device = Pairy.route(Usable);
+      if (Usable.size() > 1) logRoute();
+      Profiles = Pairy.expectedProfiles();
+    }
+    break;
+  }
+
+  case State::Searching:
+  case State::Resolving:
+  case State::Done:
+  case State::Failed:
+    break;
+  }
+
+  bool const OfDevice = Device && Current != State::PoweringUp &&
+                        Current != State::Searching &&
+                        Current != State::Failed;
+  Pairy.flightRecorder().record(Flight::Producer::Main,
+                                Flight::Kind::Transition,
+                                std::chrono::steady_clock::now(),
+                                OfDevice? Device->row() : Flight::NoRow,
+                                nullptr, nameOf(Current));
+  if (TransitionHandler) TransitionHandler(Current);
+}
+
+// Collect the replies of outstanding adapter calls.  Returns false while
+// some are still outstanding.
+bool Pairing::settle(char const *Action)
+{
+  bool Complete = true;
+
+  for (auto &Entry: AdapterCalls) {
+    if (Entry.second) {
+      if (!Entry.second.ready()) {
+        Complete = false;
+        continue;
+      }
+      try {
+        dbus_message_unref(Entry.second.get());
+      } catch (std::exception &E) {
+        log() << "Failed to " << Action << " adapter " << Entry.first->name()
+              << ": " << E.what() << std::endl;
+      }
+      Entry.second = {};
+    }
+  }
+
+  return Complete;
+}
+
+bool Pairing::deferred(DevicePtr const &Device,
+                       std::chrono::steady_clock::time_point Now) const
+{
+  auto Entry = Schedule.find(Device->address());
+
+  return Entry != Schedule.end() && Now < Entry->second.NotBefore;
+}
+
+// Authentication failures mean a wrong PIN or a user saying no, so such
+// devices are left alone for long.  Everything else is assumed to be
+// radio trouble and retried with jittered exponential backoff.
+std::chrono::steady_clock::duration
+Pairing::defer(Attempts &Attempt, BlueZ::Error const &E)
+{
+  using std::chrono::milliseconds;
+  milliseconds Delay;
+
+  if (dynamic_cast<BlueZ::AuthenticationFailed const *>(&E) ||
+      dynamic_cast<BlueZ::AuthenticationRejected const *>(&E)) {
+    Delay = std::chrono::minutes(2);
+  } else {
+    // 1s doubling per failure, up to 32s.
+    milliseconds::rep const Ceiling = 1000 << std::min(Attempt.Failures - 1, 5u);
+    std::uniform_int_distribution<milliseconds::rep> Random(Ceiling / 2, Ceiling);
+    Delay = milliseconds(Random(Jitter));
+  }
+  Attempt.NotBefore = std::chrono::steady_clock::now() + Delay;
+
+  return Delay;
+}
+
+void Pairing::paired()
+{
+  if (Device->isTrusted()) {
+    log() << "Device " << Device->name() << " already trusted." << std::endl;
+    enter(State::Searching);
+  } else {
+    enter(State::Trusting);
+  }
+}
+
+// Returns true if the state changed and should be evaluated again.
+bool Pairing::step()
+{
+  using std::chrono::seconds;
+  auto const Now = std::chrono::steady_clock::now();
+
+  if (Now > Deadline) {
+    fail("Giving up, sorry.");
+    return true;
+  }
+
+  switch (Current) {
+  case State::PoweringUp: {
+    bool Complete = settle("power up");
+
+    for (auto const &Entry: AdapterCalls) {
+      if (Entry.first->exists() && !Entry.first->isPowered()) Complete = false;
+    }
+    if (!Complete && Now - PhaseStart < seconds(1)) return false;
+
+    for (auto const &Entry: AdapterCalls) {
+      if (Entry.first->exists() && !Entry.first->isPowered()) {
+        log() << "Failed to power up adapter " << Entry.first->name()
+              << ", ignored." << std::endl;
+      }
+    }
+    AdapterCalls.clear();
+
+    if (Pairy.poweredAdapters().empty()) {
+      log() << "No Bluetooth adapters available yet." << std::endl;
+    }
+    enter(State::Searching);
+
+    return true;
+  }
+
+  case State::Searching:
+    if (!Pairy.usableDevices().empty()) {
+      AdapterCalls.clear();
+      enter(State::Connecting);
+      return true;
+    }
+
+    if (Candidates.empty()) Candidates = Pairy.pairableDevices();
+    while (!Candidates.empty()) {
+      auto Siblings = Bluepairy::siblings(Candidates.front(), Candidates);
+      auto const &Address = Siblings.front()->address();
+
+      Candidates.erase(remove_if(begin(Candidates), end(Candidates),
+                                 [&Address](auto const &Candidate) {
+                                   return Candidate->address() == Address;
+                                 }),
+                       end(Candidates));
+      Siblings.erase(remove_if(begin(Siblings), end(Siblings),
+                               [this, Now](auto const &Sibling) {
+                                 return !Sibling->exists() ||
+                                        Sibling->isPaired() ||
+                                        deferred(Sibling, Now);
+                               }),
+                     end(Siblings));
+      if ((Device = Pairy.route(Siblings))) {
+        if (Siblings.size() > 1) logRoute();
+        enter(State::Pairing);
+        return true;
+      }
+    }
+
+    // A known address needs neither discovery nor a name.  Ask the least
+    // loaded adapter to create the device, and discover only if that fails.
+    if (!Pairy.targetAddress().empty() && !ConnectDeviceTried) {
+      if (!Call) {
+        if (!Pairy.targetDevices().empty()) {
+          ConnectDeviceTried = true;
+          return true;
+        }
+
+        auto Adapters = Pairy.poweredAdapters();
+        if (Adapters.empty()) return false;
+
+        auto Load = [](auto const &Adapter) {
+          return Adapter->connectedDevices() + Adapter->outstandingOperations();
+        };
+        auto Adapter = *min_element(begin(Adapters), end(Adapters),
+                                    [&Load](auto const &A, auto const &B) {
+                                      return Load(A) < Load(B);
+                                    });
+        log() << "Connecting to " << Pairy.targetAddress() << " via adapter "
+              << Adapter->name() << std::endl;
+        Call = watch(Adapter->beginConnectDevice(Pairy.targetAddress()));
+        Adapter->track(Call);
+
+        return false;
+      }
+
+      if (!Call.ready()) return false;
+
+      try {
+        dbus_message_unref(Call.get());
+        DeviceCreated = true;
+      } catch (BlueZ::Error &E) {
+        log() << "Failed to connect to " << Pairy.targetAddress() << ": "
+              << E.what() << ", falling back to discovery" << std::endl;
+      }
+      Call = {};
+      ConnectDeviceTried = true;
+      PhaseStart = Now;
+
+      return true;
+    }
+
+    if (!AdapterCalls.empty()) {
+      if (!settle("start discovery on")) return false;
+
+      if (Pairy.isDiscovering()) {
+        log() << "Started discovery mode" << std::endl;
+      } else if (Now - PhaseStart < seconds(1)) {
+        return false;
+      }
+      AdapterCalls.clear();
+    } else if (!Pairy.isDiscovering()) {
+      // The reply to ConnectDevice may overtake the new device object.
+      if (DeviceCreated && Now - PhaseStart < seconds(1)) return false;
+
+      for (auto Adapter: Pairy.poweredAdapters()) {
+        if (!Adapter->isDiscovering()) {
+          AdapterCalls.emplace_back(Adapter, watch(Adapter->beginDiscovery()));
+        }
+      }
+      PhaseStart = Now;
+    }
+
+    return false;
+
+  case State::Pairing: {
+    if (!Call.ready()) return false;
+
+    auto &Attempt = Schedule[Device->address()];
+    auto const Latency = Now - PhaseStart;
+    Attempt.Count += 1;
+    Attempt.TotalLatency += Latency;
+    Attempt.MaxLatency = std::max(Attempt.MaxLatency, Latency);
+
+    try {
+      dbus_message_unref(Call.get());
+      Call = {};
+      log() << "Paired successfully with " << Device->name() << std::endl;
+    } catch (BlueZ::AlreadyExists &) {
+      Call = {};
+      log() << "Already paired with " << Device->name() << std::endl;
+    } catch (BlueZ::Error &E) {
+      Call = {};
+      Attempt.Failures += 1;
+      Attempt.LastError = E.what();
+      auto const Delay = defer(Attempt, E);
+      log() << "Failed to pair with " << Device->name()
+            << ": " << E.what() << ", not trying again for "
+            << std::chrono::duration_cast<std::chrono::milliseconds>(Delay).count()
+            << "ms" << std::endl;
+      enter(State::Searching);
+
+      return true;
+    }
+
+    if (Pairy.pairFirst() && !ProfilesKnown) {
+      enter(State::Resolving);
+    } else {
+      paired();
+    }
+
+    return true;
+  }
+
+  // Paired before the profiles were known.  BlueZ browses services after
+  // pairing and sets ServicesResolved once it is done.
+  case State::Resolving: {
+    using std::chrono::milliseconds;
+
+    if (Call) {
+      if (!Call.ready()) return false;
+
+      try {
+        dbus_message_unref(Call.get());
+      } catch (BlueZ::Error &E) {
+        log() << "Failed to unpair " << Device->name()
+              << ": " << E.what() << std::endl;
+      }
+      Call = {};
+      enter(State::Searching);
+
+      return true;
+    }
+    if (!Device->exists()) {
+      enter(State::Searching);
+
+      return true;
+    }
+
+    if (Pairy.hasExpectedProfiles(Device)) {
+      auto const Lead = Now - PairingStart;
+      Saved += Lead;
+      log() << "Profiles of " << Device->name() << " known "
+            << std::chrono::duration_cast<milliseconds>(Lead).count()
+            << "ms after pairing started" << std::endl;
+      paired();
+
+      return true;
+    }
+    if (!Device->servicesResolved() && Now - PhaseStart < seconds(10)) {
+      return false;
+    }
+
+    auto &Attempt = Schedule[Device->address()];
+    Attempt.Failures += 1;
+    if (Device->servicesResolved()) {
+      // Not what we are looking for, and never will be.
+      Attempt.LastError = "Expected profiles not offered";
+      Attempt.NotBefore = std::chrono::steady_clock::time_point::max();
+      log() << Device->name() << " does not offer the expected profiles, "
+            << "unpairing" << std::endl;
+    } else {
+      // Service discovery can fail like pairing, so try again later.
+      BlueZ::Failed const E("Services not resolved");
+      Attempt.LastError = E.what();
+      auto const Delay = defer(Attempt, E);
+      log() << "Services of " << Device->name() << " not resolved, "
+            << "unpairing and not trying again for "
+            << std::chrono::duration_cast<milliseconds>(Delay).count()
+            << "ms" << std::endl;
+    }
+    auto const Adapter = Device->adapter();
+    if (!Adapter) {
+      enter(State::Searching);
+
+      return true;
+    }
+    Call = watch(Adapter->beginRemoveDevice(Device.get()));
+
+    return false;
+  }
+
+  case State::Trusting:
+    if (Call) {
+      if (!Call.ready()) return false;
+
+      try {
+        dbus_message_unref(Call.get());
+        Call = {};
+      } catch (BlueZ::Error &E) {
+        Call = {};
+        log() << "Failed to trust " << Device->name()
+              << ": " << E.what() << std::endl;
+        enter(State::Searching);
+
+        return true;
+      }
+    }
+    if (Device->exists() && !Device->isTrusted()) return false;
+
+    enter(State::Searching);
+
+    return true;
+
+  case State::Connecting:
+    if (Call) {
+      if (!Call.ready()) return false;
+
+      try {
+        dbus_message_unref(Call.get());
+        Call = {};
+      } catch (BlueZ::Error &E) {
+        fail("Failed to connect to " + Profiles.front() + ": " + E.what());
+
+        return true;
+      }
+      Profiles.erase(begin(Profiles));
+    }
+
+    if (Profiles.empty()) {
+      enter(State::Done);
+
+      return true;
+    }
+
+    log() << "Trying to connect to " << Profiles.front() << std::endl;
+    Call = watch(Device->beginConnectProfile(Profiles.front()));
+
+    return false;
+
+  case State::Done:
+  case State::Failed:
+    break;
+  }
+
+  return false;
+}
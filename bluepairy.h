@@ -0,0 +1,104 @@
+#if !defined(BLUEPAIRY_H)
+#define BLUEPAIRY_H
+
+/* C interface to libbluepairy.
+ *
+ * A bluepairy handle attaches to a DBusConnection owned by the caller.  The
+ * caller keeps running its own main loop and dispatching the connection;
+ * bluepairy installs a message filter to follow BlueZ signals and to
+ * answer the pairing agent requests.  Nothing in this interface blocks,
+ * except bluepairy_new() which waits for BlueZ to list its objects.
+ */
+
+#include <stddef.h>
+
+#include <dbus/dbus.h>
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+typedef struct bluepairy bluepairy;
+
+typedef enum {
+  BLUEPAIRY_POWERING_UP,
+  BLUEPAIRY_SEARCHING,
+  BLUEPAIRY_PAIRING,
+  BLUEPAIRY_TRUSTING,
+  BLUEPAIRY_CONNECTING,
+  BLUEPAIRY_DONE,
+  BLUEPAIRY_FAILED
+} bluepairy_state;
+
+typedef void (*bluepairy_callback)(bluepairy *, bluepairy_state, void *data);
+
+/* Returns NULL on failure.  If error is not NULL, it is then set to a
+ * message which has to be released with free().
+ * name_regex may be NULL if an address is set with bluepairy_set_address().
+ * uuids is a NULL terminated list of profiles the device has to offer,
+ * it may be NULL. */
+bluepairy *bluepairy_new(DBusConnection *connection, char const *name_regex,
+                         char const * const *uuids, char **error);
+void bluepairy_free(bluepairy *);
+
+/* Pair the device with this address ("00:07:80:12:34:56") instead of
+ * matching names, without discovery if BlueZ supports ConnectDevice.
+ * Call before bluepairy_start().  Returns 0 on success and -1 if the
+ * address is malformed. */
+int bluepairy_set_address(bluepairy *, char const *address);
+
+/* Pair matching devices before their profiles are known and unpair them
+ * again if they turn out not to offer all of them.  Call before
+ * bluepairy_start(). */
+void bluepairy_set_pair_first(bluepairy *, int enable);
+
+/* Start pairing and connecting asynchronously.  callback is invoked from
+ * within dbus_connection_dispatch() or bluepairy_process() on every state
+ * change.  Returns 0 on success and -1 if pairing was already started. */
+int bluepairy_start(bluepairy *, unsigned timeout_seconds,
+                    bluepairy_callback callback, void *data);
+
+/* Check timeouts.  Call this periodically, for instance once a second. */
+bluepairy_state bluepairy_process(bluepairy *);
+
+bluepairy_state bluepairy_get_state(bluepairy const *);
+/* Reason for BLUEPAIRY_FAILED, or NULL. */
+char const *bluepairy_get_error(bluepairy const *);
+
+/* Usable devices are paired, match the name and offer all profiles.
+ * Returned strings remain valid until the connection is dispatched. */
+size_t bluepairy_get_usable_count(bluepairy const *);
+int bluepairy_get_usable(bluepairy const *, size_t index,
+                         char const **name, char const **address);
+
+/* Immutable copies of the device model for threads other than the one
+ * dispatching the connection. */
+typedef struct bluepairy_snapshot bluepairy_snapshot;
+
+/* Publish a snapshot now, and whenever the model changed from then on.
+ * Call from the dispatching thread.  Returns 0 on success and -1 if
+ * memory ran out. */
+int bluepairy_publish_snapshots(bluepairy *);
+
+/* The latest snapshot, from any thread and without locking.  NULL if
+ * bluepairy_publish_snapshots() was not called or memory ran out.  Holding
+ * a snapshot does not block publishing, but at most 64 can be held at the
+ * same time, so release it soon.  All of them have to be released before
+ * bluepairy_free(). */
+bluepairy_snapshot *bluepairy_snapshot_read(bluepairy const *);
+void bluepairy_snapshot_release(bluepairy_snapshot *);
+
+/* Counts publications, so equal generations mean equal contents. */
+unsigned long long bluepairy_snapshot_generation(bluepairy_snapshot const *);
+
+/* Like bluepairy_get_usable(), but returned strings remain valid until the
+ * snapshot is released. */
+size_t bluepairy_snapshot_usable_count(bluepairy_snapshot const *);
+int bluepairy_snapshot_get_usable(bluepairy_snapshot const *, size_t index,
+                                  char const **name, char const **address);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif /* BLUEPAIRY_H */
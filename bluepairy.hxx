@@ -1,21 +1,84 @@
 #if !defined(BLUEPAIRY_HPP)
 #define BLUEPAIRY_HPP
 
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <map>
 #include <memory>
+#include <random>
 #include <regex>
 #include <set>
 #include <stdexcept>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 #include <dbus/dbus.h>
 
+#include "rcu.hxx"
+
+namespace Flight {
+  class Recorder;
+}
+
+namespace Trace {
+  class Writer;
+}
+
 namespace DBus {
+  // Holds a reference to a connection, and closes it first if it is
+  // private.
+  class Connection {
+    DBusConnection *Bus;
+    bool const Private;
+
+  public:
+    Connection(DBusConnection *Bus, bool Private) : Bus(Bus), Private(Private) {}
+    Connection(Connection const &) = delete;
+    Connection &operator=(Connection const &) = delete;
+    ~Connection() {
+      if (Bus == nullptr) return;
+      if (Private) dbus_connection_close(Bus);
+      dbus_connection_unref(Bus);
+    }
+
+    operator DBusConnection *() const { return Bus; }
+  };
+
   class PendingCall {
+  public:
+    // A call made while replaying a trace, completed by the recorded reply.
+    struct Replayed {
+      DBusMessage *Reply = nullptr;
+      bool Completed = false;
+      std::function<void()> Notify;
+
+      Replayed() = default;
+      Replayed(Replayed const &) = delete;
+      Replayed &operator=(Replayed const &) = delete;
+      ~Replayed() { if (Reply) dbus_message_unref(Reply); }
+
+      void complete(DBusMessage *);
+    };
+
+  private:
     DBusPendingCall *Pending;
+    std::shared_ptr<Replayed> Replay;
+    Flight::Recorder *Recorder = nullptr;
+    Trace::Writer *Tracer = nullptr;
+    dbus_uint32_t Serial = 0;
+    std::chrono::steady_clock::time_point Sent;
 
   public:
     PendingCall() : Pending(nullptr) {}
+    explicit PendingCall(std::shared_ptr<Replayed> Replay)
+    : Pending(nullptr), Replay(std::move(Replay)) {}
     PendingCall(PendingCall const &);
     PendingCall(PendingCall &&);
     PendingCall &operator=(PendingCall const &);
@@ -23,9 +86,21 @@ namespace DBus {
     ~PendingCall();
 
     void send(DBusConnection *, DBusMessage *&&);
+    // Record the reply once get() collects it.
+    void recordTo(Flight::Recorder *, dbus_uint32_t Serial);
+    // Write the reply to a trace once get() collects it.
+    void traceTo(Trace::Writer *Writer) { Tracer = Writer; }
     void block() const;
     bool ready() const;
     DBusMessage *get() const;
+
+    explicit operator bool() const { return Pending != nullptr || Replay; }
+    // Run Function from the dispatching thread once the reply arrived.
+    void notify(std::function<void()> Function);
+    // Never run the notify function, and drop the reply if it is still
+    // outstanding.  libdbus keeps the call alive until the reply arrives,
+    // so this has to happen before whatever the notify refers to is gone.
+    void cancel();
   };
 }
 
@@ -42,6 +117,9 @@ namespace BlueZ {
   struct AlreadyExists : Error {
     AlreadyExists(char const *Message) : Error(Message) {}
   };
+  struct AuthenticationCanceled : Error {
+    AuthenticationCanceled(char const *Message) : Error(Message) {}
+  };
   struct AuthenticationFailed: Error {
     AuthenticationFailed(char const *Message) : Error(Message) {}
   };
@@ -78,6 +156,7 @@ namespace BlueZ {
     std::string Name;
     bool Powered;
     bool Discovering;
+    mutable std::vector<DBus::PendingCall> Operations;
 
   public:
     static constexpr char const * const Interface = "org.bluez.Adapter1";
@@ -87,11 +166,25 @@ namespace BlueZ {
       static constexpr char const * const Discovering = "Discovering";
       static constexpr char const * const Powered = "Powered";
     };
+    // Decoded a{sv} of Adapter1 properties, independent of the model.
+    struct Changes {
+      enum : unsigned {
+        AddressBit = 1 << 0, NameBit = 1 << 1,
+        PoweredBit = 1 << 2, DiscoveringBit = 1 << 3
+      };
+      unsigned Set = 0;
+      std::string Address, Name;
+      bool Powered, Discovering;
+
+      void decode(DBusMessageIter &);
+    };
+
     Adapter(std::string const &Path, ::Bluepairy *Pairy)
     : Object(Path, Pairy) {}
 
     bool exists() const;
     void onPropertiesChanged(DBusMessageIter &);
+    void update(Changes const &);
 
     std::string const &address() const { return Address; }
     std::string const &name() const { return Name; }
@@ -99,60 +192,322 @@ namespace BlueZ {
     void power(bool);
     bool isDiscovering() const { return Discovering; }
 
+    // Load counters used to spread pairing and connections over adapters.
+    std::size_t connectedDevices() const;
+    std::size_t outstandingOperations() const;
+    void track(DBus::PendingCall const &Operation) const;
+    void cancelOperations() const;
+
+    DBus::PendingCall setPowered(bool) const;
+    DBus::PendingCall beginDiscovery() const;
     void startDiscovery() const;
+    DBus::PendingCall beginRemoveDevice(Device const *) const;
     void removeDevice(Device const *) const;
+    // Object path BlueZ uses for the device with Address on this adapter.
+    std::string devicePath(std::string const &Address) const;
+    // Create the device object without discovery and connect to it.
+    DBus::PendingCall beginConnectDevice(std::string const &Address) const;
   };
 
   class AgentManager;
 
+  // Device1 properties of all devices, one column per property, indexed
+  // by a dense row number.  Rows of removed devices are reused once no
+  // Device refers to them anymore.
+  struct DeviceTable final {
+    using Row = std::uint32_t;
+    using StringId = std::uint32_t;
+
+    std::vector<std::uint8_t> Live;
+    std::vector<std::shared_ptr<Adapter>> AdapterOf;
+    std::vector<std::string> Address, Modalias;
+    std::vector<StringId> Name;
+    std::vector<std::uint8_t> Connected, Paired, Trusted, Blocked,
+                              ServicesResolved;
+    std::vector<dbus_int16_t> RSSI;
+    std::vector<std::uint32_t> Class;
+    std::vector<std::uint16_t> Appearance;
+    std::vector<std::set<std::string>> UUIDs;
+    std::vector<std::map<std::uint16_t, std::vector<std::uint8_t>>>
+      ManufacturerData;
+    std::vector<std::chrono::steady_clock::time_point> LastSeen;
+    // Changes bits since clearChanges().
+    std::vector<unsigned> Changed;
+    // Properties left in a GetManagedObjects reply until they are needed.
+    struct Deferred {
+      std::shared_ptr<DBusMessage> Message;
+      DBusMessageIter Properties;
+      unsigned Bits = 0;
+    };
+    std::vector<Deferred> Details;
+
+    DeviceTable() { intern(std::string()); }
+    DeviceTable(DeviceTable const &) = delete;
+    DeviceTable &operator=(DeviceTable const &) = delete;
+
+    std::size_t size() const { return Live.size(); }
+    Row add();
+    void release(Row);
+    void changed(Row, unsigned Bits);
+    void clearChanges();
+    // Rows with Changed bits.
+    std::vector<Row> const &changedRows() const { return ChangedRows; }
+
+    // Equal names get the same id, so they compare by id.  Every intern()
+    // takes a reference, and the id is reused once all are released.  The
+    // empty name is always 0.
+    StringId intern(std::string const &);
+    void releaseString(StringId);
+    std::string const &string(StringId Id) const { return Strings[Id]; }
+    // By name for Bluepairy::nameMatches(): 0 if not matched yet, 1 if the
+    // pattern does not match, 2 if it does.
+    std::vector<std::uint8_t> NameMatches;
+
+  private:
+    std::deque<std::string> Strings;
+    std::vector<std::uint32_t> References;
+    std::unordered_map<std::string, StringId> StringIds;
+    std::vector<StringId> FreeStrings;
+    std::vector<Row> Free, ChangedRows;
+  };
+
   class Device final : public Object {
-    std::shared_ptr<Adapter> AdapterPtr;
-    std::string Address;
-    bool Connected;
-    std::string Name;
-    bool Paired, Trusted;
-    std::set<std::string> UUIDs;
+    std::shared_ptr<DeviceTable> const Table;
+    DeviceTable::Row const Row;
 
   public:
     static constexpr char const * const Interface = "org.bluez.Device1";
+    static constexpr dbus_int16_t NoRSSI = INT16_MIN;
     struct Property {
       static constexpr char const * const Adapter = "Adapter";
       static constexpr char const * const Address = "Address";
+      static constexpr char const * const Appearance = "Appearance";
+      static constexpr char const * const Blocked = "Blocked";
+      static constexpr char const * const Class = "Class";
       static constexpr char const * const Connected = "Connected";
+      static constexpr char const * const ManufacturerData = "ManufacturerData";
+      static constexpr char const * const Modalias = "Modalias";
       static constexpr char const * const Name = "Name";
       static constexpr char const * const Paired = "Paired";
+      static constexpr char const * const RSSI = "RSSI";
+      static constexpr char const * const ServicesResolved = "ServicesResolved";
       static constexpr char const * const Trusted = "Trusted";
+      static constexpr char const * const UUIDs = "UUIDs";
     };
 
-    Device(std::string const &Path, ::Bluepairy *Pairy) : Object(Path, Pairy) {}
-    bool exists() const;
+    // Decoded a{sv} of Device1 properties, independent of the model.
+    struct Changes {
+      enum : unsigned {
+        AdapterBit = 1 << 0, AddressBit = 1 << 1, ConnectedBit = 1 << 2,
+        NameBit = 1 << 3, PairedBit = 1 << 4, TrustedBit = 1 << 5,
+        UUIDsBit = 1 << 6, RSSIBit = 1 << 7, ClassBit = 1 << 8,
+        AppearanceBit = 1 << 9, ManufacturerDataBit = 1 << 10,
+        BlockedBit = 1 << 11, ServicesResolvedBit = 1 << 12,
+        ModaliasBit = 1 << 13
+      };
+      // Only needed to tell a device apart before its Name is known, or
+      // to decide whether it is usable.
+      static constexpr unsigned DetailBits =
+        UUIDsBit | ClassBit | AppearanceBit | ManufacturerDataBit | ModaliasBit;
+      unsigned Set = 0;
+      std::string Adapter, Address, Name, Modalias;
+      bool Connected, Paired, Trusted, Blocked, ServicesResolved;
+      dbus_int16_t RSSI;
+      std::set<std::string> UUIDs;
+      std::uint32_t Class;
+      std::uint16_t Appearance;
+      std::map<std::uint16_t, std::vector<std::uint8_t>> ManufacturerData;
+
+      // Only the properties with a bit in Mask.
+      void decode(DBusMessageIter &, unsigned Mask = ~0u);
+    };
+
+    Device(std::string const &Path, ::Bluepairy *Pairy,
+           std::shared_ptr<DeviceTable> Table)
+    : Object(Path, Pairy), Table(std::move(Table)), Row(this->Table->add()) {}
+    Device(Device const &) = delete;
+    Device &operator=(Device const &) = delete;
+    ~Device() { Table->release(Row); }
+    bool exists() const { return Table->Live[Row]; }
+    DeviceTable::Row row() const { return Row; }
 
     void onPropertiesChanged(DBusMessageIter &);
+    void update(Changes const &);
 
-    std::string const &address() const { return Address; }
-    std::shared_ptr<Adapter const> adapter() const { return AdapterPtr; }
-    std::string const &name() const { return Name; }
-    bool isPaired() const { return Paired; }
-    bool isTrusted() const { return Trusted; }
+    std::string const &address() const { return Table->Address[Row]; }
+    std::shared_ptr<Adapter const> adapter() const {
+      return Table->AdapterOf[Row];
+    }
+    std::string const &name() const { return Table->string(Table->Name[Row]); }
+    bool isPaired() const { return Table->Paired[Row]; }
+    bool isTrusted() const { return Table->Trusted[Row]; }
     void trust(bool);
-    bool isConnected() const { return Connected; }
-    std::set<std::string> const &profiles() const { return UUIDs; }
+    bool isConnected() const { return Table->Connected[Row]; }
+    bool isBlocked() const { return Table->Blocked[Row]; }
+    // Set once BlueZ has discovered the services of a connected device.
+    bool servicesResolved() const { return Table->ServicesResolved[Row]; }
+    // Signal strength of the last inquiry result, or NoRSSI.
+    dbus_int16_t rssi() const { return Table->RSSI[Row]; }
+    // When the device was added, last reported an RSSI or was connected.
+    std::chrono::steady_clock::time_point lastSeen() const {
+      return Table->LastSeen[Row];
+    }
+    void seen(std::chrono::steady_clock::time_point When) {
+      Table->LastSeen[Row] = When;
+    }
+    // Decode Changes::DetailBits left behind by GetManagedObjects.
+    void resolve() const { if (Table->Details[Row].Bits) decodeDetails(); }
+    std::set<std::string> const &profiles() const {
+      resolve();
+      return Table->UUIDs[Row];
+    }
+    // Class of Device (BR/EDR) and GAP appearance (LE), or zero.
+    std::uint32_t classOfDevice() const {
+      resolve();
+      return Table->Class[Row];
+    }
+    std::uint16_t appearance() const {
+      resolve();
+      return Table->Appearance[Row];
+    }
+    // Advertised payloads by company identifier.
+    std::map<std::uint16_t, std::vector<std::uint8_t>> const &
+    manufacturerData() const {
+      resolve();
+      return Table->ManufacturerData[Row];
+    }
+    std::string const &modalias() const {
+      resolve();
+      return Table->Modalias[Row];
+    }
+    // Changes bits applied since the update handler last ran.
+    unsigned changed() const { return Table->Changed[Row]; }
 
     DBus::PendingCall pair() const;
+    DBus::PendingCall setTrusted(bool) const;
 
+    DBus::PendingCall beginConnectProfile(std::string) const;
     void connectProfile(std::string) const;
+
+  private:
+    void decodeDetails() const;
+    // Writes the properties to the table, but leaves Adapter and the
+    // Changed bits alone.  Only modifies the table, hence const.
+    void store(Changes const &) const;
+  };
+
+  // Objects below a device, like GATT services and characteristics or
+  // media endpoints.  Nothing there concerns pairing.
+  inline bool isBelowDevice(char const *Path) {
+    auto Device = strstr(Path, "/dev_");
+    return Device != nullptr && strchr(Device + 1, '/') != nullptr;
+  }
+
+  // A decoded bus signal, ready to be applied to the model.
+  struct Event {
+    enum class Kind : unsigned char {
+      AdapterChanged, DeviceChanged, AdapterRemoved, DeviceRemoved, Error
+    };
+    Kind What;
+    std::string Path;    // D-Bus error name for Kind::Error
+    std::string Message; // Kind::Error only
+    Adapter::Changes AdapterChanges;
+    Device::Changes DeviceChanges;
+    std::chrono::steady_clock::time_point Received;
   };
 }
 
 class Bluepairy final {
   static constexpr char const * const AgentPath = "/bluepairy/agent";
+  static constexpr char const * const MatchRule =
+    "type='signal',sender='org.bluez'";
+
+public:
+  // Advertised properties which identify the target before its Name is
+  // known.  Every kind which is given has to match one of its values.
+  struct Hints {
+    // Major and minor device class, service class bits are ignored.
+    std::vector<std::uint32_t> Classes;
+    std::vector<std::uint16_t> Appearances;
+    struct Manufacturer {
+      std::uint16_t Company;
+      std::vector<std::uint8_t> Prefix;
+    };
+    std::vector<Manufacturer> Manufacturers;
+    // Any of these service UUIDs.
+    std::vector<std::string> UUIDs;
+
+    bool empty() const {
+      return Classes.empty() && Appearances.empty() &&
+             Manufacturers.empty() && UUIDs.empty();
+    }
+  };
+
+  // Immutable copy of the model for other threads, see snapshot().
+  struct Snapshot {
+    struct Adapter {
+      std::string Path, Address, Name;
+      bool Powered, Discovering;
+    };
+    struct Device {
+      std::string Path, Adapter, Address, Name;
+      bool Paired, Trusted, Connected, ServicesResolved, Blocked, Usable;
+      // Changes with every advertisement while discovering, so it is
+      // updated in place and may be newer than the rest of the snapshot.
+      mutable std::atomic<dbus_int16_t> RSSI;
+      std::set<std::string> UUIDs;
+    };
+    // Devices by DeviceTable row, null where there is none.
+    static constexpr std::size_t ChunkSize = 64;
+    using Chunk = std::array<std::shared_ptr<Device const>, ChunkSize>;
+
+    // Counts publications.
+    std::uint64_t Generation;
+    std::vector<Adapter> Adapters;
+    // Chunks and devices which did not change are shared with earlier
+    // snapshots.
+    std::vector<std::shared_ptr<Chunk const>> Chunks;
+
+    template<typename Function> void forEachDevice(Function F) const {
+      for (auto const &Chunk: Chunks) {
+        for (auto const &Device: *Chunk) if (Device) F(*Device);
+      }
+    }
+  };
 
+private:
+  // First, so that it is released last, even if the constructor throws.
+  DBus::Connection const SystemBus;
+  bool const OwnsBus;
   std::regex Pattern;
+  std::string TargetAddress;
+  Hints TargetHints;
+  bool PairFirst = false;
   std::vector<std::string> ExpectedUUIDs;
 
-  DBusConnection *SystemBus;
-  DBusPreallocatedSend *Send;
+  mutable DBusPreallocatedSend *Send;
+  // What the constructor set up on the connection so far.
+  bool Filtering = false, Matching = false, AgentRegistered = false;
+  void connect();
+  // Undo it.  A private connection is closed anyway, which drops the
+  // match rule and the agent.
+  void disconnect();
   void send(DBusMessage *&&Message) const;
+  DBus::PendingCall call(DBusMessage *&&Message) const;
+  std::unique_ptr<Trace::Writer> Recorder;
+  std::unique_ptr<Flight::Recorder> Flight;
+  std::string describeRow(BlueZ::DeviceTable::Row) const;
+
+  // Replaying: recorded calls not yet made again, calls made before their
+  // recorded counterpart showed up, and both by recorded serial.
+  struct Expectation {
+    std::string Path, Member;
+    std::shared_ptr<DBus::PendingCall::Replayed> Outcome;
+  };
+  mutable std::deque<Expectation> Unclaimed, Unmatched;
+  std::unordered_map<dbus_uint32_t,
+                     std::shared_ptr<DBus::PendingCall::Replayed>> Replies;
+  std::shared_ptr<DBus::PendingCall::Replayed> claim(DBusMessage *) const;
   
   std::vector<std::shared_ptr<BlueZ::Adapter>> Adapters;
   using AdapterPtr = decltype(Adapters)::value_type;
@@ -161,59 +516,198 @@ class Bluepairy final {
     
   std::vector<std::shared_ptr<BlueZ::Device>> Devices;
   using DevicePtr = decltype(Devices)::value_type;
+  std::shared_ptr<BlueZ::DeviceTable> Table =
+    std::make_shared<BlueZ::DeviceTable>();
+  std::vector<DevicePtr> ByRow;
+  std::unordered_map<std::string, DevicePtr> ByPath;
   DevicePtr getDevice(char const *Path);
   void removeDevice(char const *Path);
 
-  void updateObjectProperties(DBusMessageIter *);
+  bool loadManagedObjects(DBusMessage *);
+  static void decodeObjectProperties(DBusMessageIter *, std::vector<BlueZ::Event> &);
+
+  std::vector<BlueZ::Event> Decoded;
+  static DBusHandlerResult filter(DBusConnection *, DBusMessage *, void *);
+  bool handleMessage(DBusMessage *,
+                     std::function<std::string(char const *)> const &NameOf,
+                     std::vector<BlueZ::Event> &) const;
+  // The PIN is derived from the name, which devices matched by hints may
+  // not have yet.  Their RequestPinCode waits for it, and is canceled if
+  // it does not arrive in time.  Only used by the dispatching thread.
+  struct PINRequest {
+    std::shared_ptr<DBusMessage> Message;
+    std::string Device;
+    std::chrono::steady_clock::time_point Received;
+  };
+  mutable std::vector<PINRequest> PINRequests;
+  void answerPIN(DBusMessage *Request, std::string const &Name) const;
+  void answerPINRequests
+  (std::function<std::string(char const *)> const &NameOf) const;
+  void apply(BlueZ::Event &);
+  std::exception_ptr DeferredError;
+  std::function<void()> UpdateHandler;
+  void updated();
+
+  mutable RCU<Snapshot> Snapshots;
+  bool PublishSnapshots = false, SnapshotOutdated = false;
+  std::uint64_t Generation = 0;
+  // Last published Snapshot::Device by DeviceTable row and the chunks
+  // containing them, null once the device changed.
+  std::vector<std::shared_ptr<Snapshot::Device const>> Published;
+  std::vector<std::shared_ptr<Snapshot::Chunk const>> PublishedChunks;
+  void outdate(BlueZ::DeviceTable::Row);
+  void outdate();
+  void publish();
+
+  class IOThread;
+  std::unique_ptr<IOThread> IO;
+
+  class StateSocket;
+  std::unique_ptr<StateSocket> State;
 
   friend class BlueZ::Adapter;
   friend class BlueZ::AgentManager;
   friend class BlueZ::Device;
 
+  Bluepairy(std::string const &Pattern, std::vector<std::string> UUIDs,
+            DBusConnection *, bool OwnsBus);
+
 public:
+  // Opens a private connection to the system bus.
   Bluepairy(std::string const &Pattern, std::vector<std::string> UUIDs);
+  // Shares an existing connection whose main loop dispatches messages.
+  Bluepairy(std::string const &Pattern, std::vector<std::string> UUIDs,
+            DBusConnection *);
+  // Not connected to any bus, the model is only fed by replay() and calls
+  // only complete with replies from the trace.
+  struct Detached {};
+  Bluepairy(std::string const &Pattern, std::vector<std::string> UUIDs,
+            Detached);
   Bluepairy(Bluepairy const &) = delete;
   Bluepairy(Bluepairy &&) = delete;
   Bluepairy &operator= (Bluepairy &&) = delete;
   Bluepairy &operator= (Bluepairy const &) = delete;
   ~Bluepairy();
 
+  // Block up to 10ms for bus traffic, dispatch it and process().
   void readWrite();
-    
+  // Rethrow errors deferred from dispatching, answer PIN requests which
+  // waited for a name and serve state clients.  Never blocks, so it may be
+  // called from a foreign main loop.
+  void process();
+  // Called after dispatched messages changed the model.
+  void onUpdate(std::function<void()> Handler) {
+    UpdateHandler = std::move(Handler);
+  }
+
+  // Move bus I/O, agent replies and signal decoding to a dedicated thread.
+  // readWrite() then only applies the decoded events to the model.
+  void startIOThread();
+  bool isThreaded() const { return bool(IO); }
+
+  struct EventStats {
+    std::size_t Events = 0, MaxQueueDepth = 0, Overflows = 0;
+    std::chrono::steady_clock::duration TotalLatency{}, MaxLatency{};
+  };
+  EventStats eventStats() const;
+
+  // Publish the model on a Unix stream socket.  Every client first gets a
+  // snapshot of all adapters and devices, then a batch of changed objects
+  // whenever readWrite() applied changes.  Batches end with a "." line.
+  void serveState(std::string const &SocketPath);
+
+  // Publish a Snapshot now and from process() whenever the model changed
+  // since.  Call from the thread which runs readWrite().
+  void publishSnapshots();
+  // The latest published Snapshot, from any thread and without locking.
+  // Holding it keeps that version alive and does not block publishing,
+  // but release it soon, the number of concurrent readers is limited.
+  // False if publishSnapshots() was not called.
+  RCU<Snapshot>::Reader snapshot() const { return Snapshots.read(); }
+
+  // Write all received messages, replies collected by get() and all sent
+  // messages to a trace file, starting with a fresh GetManagedObjects
+  // reply.  Has to be called
+  // before startIOThread().
+  void record(std::string const &TracePath);
+  // Feed a recorded message through the decoder and the model as if it
+  // had just been dispatched.  Recorded replies complete the calls made
+  // since, see expect().
+  void replay(DBusMessage *);
+  // A call recorded as sent.  Calls made while replaying are matched to
+  // these by object path and method, in order, and completed by their
+  // recorded replies.
+  void expect(DBusMessage *);
+
+  // Always on: calls, replies, agent requests, changes to matching
+  // devices and, from Pairing, state transitions.
+  Flight::Recorder &flightRecorder() const { return *Flight; }
+
+  // Cached by interned name, so every name is only matched once.
+  bool nameMatches(BlueZ::DeviceTable::StringId Name) const;
   bool nameMatches(DevicePtr Device) const {
-    return regex_search(Device->name(), Pattern,
-                        std::regex_constants::match_not_null);
+    return nameMatches(Table->Name[Device->row()]);
   }
 
-  bool hasExpectedProfiles(DevicePtr) const;
+  // Look for the device with this address instead of matching names.
+  // Its profiles are then only required once it is paired.
+  void targetAddress(std::string Address);
+  std::string const &targetAddress() const { return TargetAddress; }
 
-  decltype(Devices) usableDevices() const {
-    decltype(Devices) Result;
+  // Pair matching devices before their profiles are known, Pairing then
+  // checks them once services are resolved.
+  void pairFirst(bool Value) { PairFirst = Value; }
+  bool pairFirst() const { return PairFirst; }
 
-    for (auto Device: Devices) {
-      if (Device->adapter()->isPowered() && Device->isPaired() &&
-          nameMatches(Device) && hasExpectedProfiles(Device)) {
-        Result.push_back(Device);
-      }
+  // Match devices without a Name yet by these hints.
+  void targetHints(Hints Hints) {
+    TargetHints = std::move(Hints);
+    outdate();
+  }
+  Hints const &targetHints() const { return TargetHints; }
+  bool hintsMatch(DevicePtr) const;
+
+  // By address if one is given, by name once it is known, else by hints.
+  bool matches(DevicePtr Device) const {
+    if (!TargetAddress.empty()) return Device->address() == TargetAddress;
+    if (!Device->name().empty() || TargetHints.empty()) {
+      return nameMatches(Device);
     }
-
-    return Result;
+    return hintsMatch(Device);
   }
 
-  decltype(Devices) pairableDevices() const {
-    decltype(Devices) Result;
+  decltype(Adapters) const &adapters() const { return Adapters; }
+  decltype(Devices) const &devices() const { return Devices; }
+  // Null if no device has this object path.
+  DevicePtr findDevice(char const *Path) const;
+  // Objects of the target address on powered adapters, by object path.
+  decltype(Devices) targetDevices() const;
 
-    for (auto Device: Devices) {
-      if (Device->adapter()->exists() && Device->adapter()->isPowered() &&
-          !Device->isPaired() && this->nameMatches(Device) &&
-          this->hasExpectedProfiles(Device)) {
-        Result.push_back(Device);
-      }
-    }
+  bool hasExpectedProfiles(DevicePtr) const;
+  std::vector<std::string> const &expectedProfiles() const {
+    return ExpectedUUIDs;
+  }
 
-    return Result;
+  bool isUsable(DevicePtr Device) const {
+    return Device->adapter() && Device->adapter()->isPowered() &&
+           Device->isPaired() &&
+           matches(Device) && hasExpectedProfiles(Device);
   }
 
+  // Both scan the Paired column first and only look closer at the rows
+  // which pass.
+  decltype(Devices) usableDevices() const;
+  decltype(Devices) pairableDevices() const;
+
+  // BlueZ keeps one object per adapter which has seen a device.  Of such
+  // Objects, pick the one on the powered adapter with the least connected
+  // devices and outstanding operations, then the one with the best RSSI.
+  // Null if none of them is on a powered adapter.
+  DevicePtr route(decltype(Devices) const &Objects) const;
+  // All of Objects which represent the same physical device as Device.
+  static decltype(Devices) siblings(DevicePtr Device,
+                                    decltype(Devices) const &Objects);
+
   decltype(Adapters) poweredAdapters() const {
     decltype(Adapters) Result;
 
@@ -227,14 +721,111 @@ public:
   }
 
   std::string guessPIN(DevicePtr) const;
+  static std::string guessPIN(std::string const &Name);
 
   void powerUpAllAdapters();
   bool isDiscovering() const;
   bool startDiscovery();
 
   void forget(DevicePtr);
+  // Paired devices matching the name (or address) which are not connected and
+  // either are superseded by another connected match, or have not been seen
+  // for Window while another match has, including their objects on other
+  // adapters.  The last match seen is never stale.
+  decltype(Devices) stalePairings(std::chrono::steady_clock::duration Window) const;
+  // Remove all of Objects at once and wait for BlueZ to confirm, at most
+  // for Timeout and no longer than all calls either failed or their
+  // objects are gone.  Returns how many of them are gone.
+  std::size_t forget(decltype(Devices) const &Objects,
+                     std::chrono::steady_clock::duration Timeout);
   void pair(DevicePtr);
   void trust(DevicePtr);
 };
 
+// Drives a Bluepairy towards a usable, connected device without ever
+// blocking on the bus: power up adapters, discover, pair, trust and
+// connect the expected profiles.  advance() has to be called whenever
+// the model changed or a method call completed.
+class Pairing final {
+public:
+  enum class State {
+    PoweringUp, Searching, Pairing, Resolving, Trusting, Connecting, Done,
+    Failed
+  };
+
+  Pairing(Bluepairy &, std::chrono::steady_clock::duration Timeout,
+          std::ostream *Log = nullptr);
+  Pairing(Pairing const &) = delete;
+  Pairing &operator=(Pairing const &) = delete;
+  ~Pairing();
+
+  State state() const { return Current; }
+  bool finished() const {
+    return Current == State::Done || Current == State::Failed;
+  }
+  std::string const &error() const { return Error; }
+
+  // Pairing attempts per device address.  Failed devices are not tried
+  // again before NotBefore.
+  struct Attempts {
+    unsigned Count = 0, Failures = 0;
+    std::chrono::steady_clock::duration TotalLatency{}, MaxLatency{};
+    std::chrono::steady_clock::time_point NotBefore;
+    std::string LastError;
+  };
+  std::map<std::string, Attempts> const &attempts() const { return Schedule; }
+  // With Bluepairy::pairFirst(), how long pairing started before the
+  // expected profiles were known.  Gating on them would have delayed
+  // pairing at least that long, unless they were advertised earlier.
+  std::chrono::steady_clock::duration timeSaved() const { return Saved; }
+
+  void advance();
+
+  // Called on every state transition.
+  void onTransition(std::function<void(State)> Handler) {
+    TransitionHandler = std::move(Handler);
+  }
+  // Arrange for Function to be called when an outstanding method call
+  // completes, for main loops that do not call advance() periodically.
+  void wakeupWith(std::function<void()> Function) {
+    Wakeup = std::move(Function);
+  }
+
+private:
+  using DevicePtr = std::shared_ptr<BlueZ::Device>;
+
+  Bluepairy &Pairy;
+  std::ostream *Log;
+  bool Started = false;
+  State Current = State::PoweringUp;
+  std::chrono::steady_clock::time_point Deadline, PhaseStart, PairingStart;
+  std::string Error;
+  std::function<void(State)> TransitionHandler;
+  std::function<void()> Wakeup;
+
+  std::vector<std::pair<std::shared_ptr<BlueZ::Adapter const>,
+                        DBus::PendingCall>> AdapterCalls;
+  DBus::PendingCall Call;
+  // Calls with a notify on Wakeup, which must not run after destruction.
+  std::vector<DBus::PendingCall> Watched;
+  bool ConnectDeviceTried = false, DeviceCreated = false, ProfilesKnown = false;
+  std::chrono::steady_clock::duration Saved{};
+  DevicePtr Device;
+  std::vector<DevicePtr> Candidates;
+  std::vector<std::string> Profiles;
+  std::map<std::string, Attempts> Schedule;
+  std::minstd_rand Jitter;
+
+  bool step();
+  bool deferred(DevicePtr const &, std::chrono::steady_clock::time_point) const;
+  std::chrono::steady_clock::duration defer(Attempts &, BlueZ::Error const &);
+  bool settle(char const *Action);
+  void paired();
+  void enter(State);
+  void fail(std::string Message);
+  DBus::PendingCall watch(DBus::PendingCall);
+  std::ostream &log() const;
+  void logRoute() const;
+};
+
 #endif // BLUEPAIRY_HPP
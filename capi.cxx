@@ -0,0 +1,202 @@
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+#include "bluepairy.h"
+#include "bluepairy.hxx"
+
+struct bluepairy {
+  std::unique_ptr<Bluepairy> Pairy;
+  std::unique_ptr<Pairing> Machine;
+  bluepairy_callback Callback = nullptr;
+  void *Data = nullptr;
+};
+
+struct bluepairy_snapshot {
+  RCU<Bluepairy::Snapshot>::Reader Reader;
+  std::vector<Bluepairy::Snapshot::Device const *> Usable;
+};
+
+namespace {
+  bluepairy_state convert(Pairing::State State) {
+    switch (State) {
+    case Pairing::State::PoweringUp: return BLUEPAIRY_POWERING_UP;
+    case Pairing::State::Searching: return BLUEPAIRY_SEARCHING;
+    case Pairing::State::Pairing:
+    case Pairing::State::Resolving: return BLUEPAIRY_PAIRING;
+    case Pairing::State::Trusting: return BLUEPAIRY_TRUSTING;
+    case Pairing::State::Connecting: return BLUEPAIRY_CONNECTING;
+    case Pairing::State::Done: return BLUEPAIRY_DONE;
+    case Pairing::State::Failed: break;
+    }
+
+    return BLUEPAIRY_FAILED;
+  }
+} // namespace
+
+extern "C" bluepairy *
+bluepairy_new(DBusConnection *Connection, char const *NameRegex,
+              char const * const *UUIDs, char **Error)
+{
+  try {
+    std::vector<std::string> Profiles;
+    for (; UUIDs && *UUIDs; ++UUIDs) Profiles.emplace_back(*UUIDs);
+
+    std::unique_ptr<bluepairy> Handle(new bluepairy);
+    Handle->Pairy.reset(new Bluepairy(NameRegex? NameRegex : "",
+                                      std::move(Profiles), Connection));
+
+    return Handle.release();
+  } catch (std::exception &E) {
+    if (Error) *Error = strdup(E.what());
+  }
+
+  return nullptr;
+}
+
+extern "C" void bluepairy_free(bluepairy *Handle)
+{
+  delete Handle;
+}
+
+extern "C" int bluepairy_set_address(bluepairy *Handle, char const *Address)
+{
+  try {
+    Handle->Pairy->targetAddress(Address);
+  } catch (std::exception &) {
+    return -1;
+  }
+
+  return 0;
+}
+
+extern "C" void bluepairy_set_pair_first(bluepairy *Handle, int Enable)
+{
+  Handle->Pairy->pairFirst(Enable != 0);
+}
+
+extern "C" int
+bluepairy_start(bluepairy *Handle, unsigned TimeoutSeconds,
+                bluepairy_callback Callback, void *Data)
+{
+  if (Handle->Machine) return -1;
+
+  Handle->Callback = Callback;
+  Handle->Data = Data;
+  Handle->Machine.reset(new Pairing(*Handle->Pairy,
+                                    std::chrono::seconds(TimeoutSeconds)));
+  Handle->Machine->onTransition([Handle](Pairing::State State) {
+    if (Handle->Callback) Handle->Callback(Handle, convert(State), Handle->Data);
+  });
+  Handle->Machine->wakeupWith([Handle] { Handle->Machine->advance(); });
+  Handle->Pairy->onUpdate([Handle] { Handle->Machine->advance(); });
+  Handle->Machine->advance();
+
+  return 0;
+}
+
+extern "C" bluepairy_state bluepairy_process(bluepairy *Handle)
+{
+  try {
+    Handle->Pairy->process();
+  } catch (std::exception &) {
+    // Unsolicited error replies are of no interest to the state machine.
+  }
+  if (Handle->Machine) Handle->Machine->advance();
+
+  return bluepairy_get_state(Handle);
+}
+
+extern "C" bluepairy_state bluepairy_get_state(bluepairy const *Handle)
+{
+  return Handle->Machine? convert(Handle->Machine->state())
+                        : BLUEPAIRY_POWERING_UP;
+}
+
+extern "C" char const *bluepairy_get_error(bluepairy const *Handle)
+{
+  if (Handle->Machine &&
+      Handle->Machine->state() == Pairing::State::Failed) {
+    return Handle->Machine->error().c_str();
+  }
+
+  return nullptr;
+}
+
+extern "C" size_t bluepairy_get_usable_count(bluepairy const *Handle)
+{
+  return Handle->Pairy->usableDevices().size();
+}
+
+extern "C" int
+bluepairy_get_usable(bluepairy const *Handle, size_t Index,
+                     char const **Name, char const **Address)
+{
+  auto Usable = Handle->Pairy->usableDevices();
+
+  if (Index >= Usable.size()) return -1;
+
+  if (Name) *Name = Usable[Index]->name().c_str();
+  if (Address) *Address = Usable[Index]->address().c_str();
+
+  return 0;
+}
+
+extern "C" int bluepairy_publish_snapshots(bluepairy *Handle)
+{
+  try {
+    Handle->Pairy->publishSnapshots();
+  } catch (std::exception &) {
+    return -1;
+  }
+
+  return 0;
+}
+
+extern "C" bluepairy_snapshot *bluepairy_snapshot_read(bluepairy const *Handle)
+{
+  try {
+    std::unique_ptr<bluepairy_snapshot> Snapshot(new bluepairy_snapshot);
+
+    Snapshot->Reader = Handle->Pairy->snapshot();
+    if (!Snapshot->Reader) return nullptr;
+    Snapshot->Reader->forEachDevice([&Snapshot](auto const &Device) {
+      if (Device.Usable) Snapshot->Usable.push_back(&Device);
+    });
+
+    return Snapshot.release();
+  } catch (std::exception &) {
+  }
+
+  return nullptr;
+}
+
+extern "C" void bluepairy_snapshot_release(bluepairy_snapshot *Snapshot)
+{
+  delete Snapshot;
+}
+
+extern "C" unsigned long long
+bluepairy_snapshot_generation(bluepairy_snapshot const *Snapshot)
+{
+  return Snapshot->Reader->Generation;
+}
+
+extern "C" size_t
+bluepairy_snapshot_usable_count(bluepairy_snapshot const *Snapshot)
+{
+  return Snapshot->Usable.size();
+}
+
+extern "C" int
+bluepairy_snapshot_get_usable(bluepairy_snapshot const *Snapshot, size_t Index,
+                              char const **Name, char const **Address)
+{
+  if (Index >= Snapshot->Usable.size()) return -1;
+
+  if (Name) *Name = Snapshot->Usable[Index]->Name.c_str();
+  if (Address) *Address = Snapshot->Usable[Index]->Address.c_str();
+
+  return 0;
+}
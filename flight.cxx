@@ -0,0 +1,121 @@
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "flight.hxx"
+
+constexpr std::size_t Flight::Recorder::Capacity;
+constexpr std::size_t Flight::Recorder::CacheLine;
+
+namespace {
+  char const *nameOf(Flight::Kind What) {
+    switch (What) {
+    case Flight::Kind::DeviceChanged: return "changed";
+    case Flight::Kind::CallSent: return "call";
+    case Flight::Kind::Reply: return "reply";
+    case Flight::Kind::AgentRequest: return "agent";
+    case Flight::Kind::Transition: break;
+    }
+
+    return "state";
+  }
+}
+
+char const *Flight::Recorder::intern(char const *Text) noexcept
+{
+  if (Text == nullptr) return nullptr;
+
+  try {
+    std::lock_guard<std::mutex> Lock(InternMutex);
+
+    return Interned.emplace(Text).first->c_str();
+  } catch (std::exception &) {
+    return nullptr;
+  }
+}
+
+std::uint64_t Flight::Recorder::size() const
+{
+  std::uint64_t Size = 0;
+
+  for (auto const &Ring: Rings) {
+    Size += Ring.Next.load(std::memory_order_relaxed);
+  }
+
+  return Size;
+}
+
+void Flight::Recorder::dump(std::ostream &Out) const
+{
+  std::vector<Event> Events;
+  std::uint64_t Recorded = 0;
+
+  for (auto const &Ring: Rings) {
+    auto const End = Ring.Next.load(std::memory_order_acquire);
+    auto const Begin = End > Capacity? End - Capacity : 0;
+
+    Recorded += End;
+    for (auto Index = Begin; Index != End; ++Index) {
+      auto const &Slot = Ring.Slots[Index % Capacity];
+
+      if (Slot.Sequence.load(std::memory_order_acquire) != Index + 1) continue;
+      Event const Copy = Slot.Data;
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (Slot.Sequence.load(std::memory_order_relaxed) != Index + 1) continue;
+
+      Events.push_back(Copy);
+    }
+  }
+  std::stable_sort(begin(Events), end(Events),
+                   [](Event const &A, Event const &B) {
+                     return A.Time < B.Time;
+                   });
+
+  auto const StartTime = std::chrono::duration_cast<std::chrono::nanoseconds>
+    (Start.time_since_epoch()).count();
+
+  Out << "# " << Recorded << " events recorded, " << Events.size()
+      << " kept\n";
+  for (auto const &Event: Events) {
+    Out << std::fixed << std::setprecision(6) << std::setw(11)
+        << (Event.Time - StartTime) / 1e9
+        << ' ' << std::left << std::setw(7)
+        << nameOf(Event.What) << std::right;
+    if (Event.Row != NoRow) {
+      Out << ' ' << (DescribeRow? DescribeRow(Event.Row)
+                                : "row " + std::to_string(Event.Row));
+    }
+    if (Event.Path) Out << ' ' << Event.Path;
+    if (Event.Name) Out << ' ' << Event.Name;
+    switch (Event.What) {
+    case Kind::DeviceChanged:
+      Out << " set=0x" << std::hex << Event.Value << std::dec;
+      break;
+    case Kind::CallSent:
+      Out << " serial=" << Event.Value;
+      break;
+    case Kind::Reply:
+      Out << " serial=" << Event.Value << " latency=" << Event.Latency << "us";
+      break;
+    case Kind::AgentRequest:
+    case Kind::Transition:
+      break;
+    }
+    Out << '\n';
+  }
+  Out.flush();
+}
+
+void Flight::Recorder::dump(char const *Path) const
+{
+  std::ofstream Out(Path, std::ios::trunc);
+
+  if (!Out) {
+    throw std::runtime_error(std::string("Failed to create ") + Path);
+  }
+  dump(Out);
+}
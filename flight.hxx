@@ -0,0 +1,122 @@
+#if !defined(FLIGHT_HPP)
+#define FLIGHT_HPP
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <iosfwd>
+#include <mutex>
+#include <string>
+#include <unordered_set>
+
+// Post-mortem record of what happened while pairing: the last Capacity
+// events of every producing thread in fixed rings which record() fills
+// without allocating or locking.  dump() writes them out as text.
+namespace Flight {
+  enum class Kind : std::uint8_t {
+    DeviceChanged, // Row: the device, Value: Device::Changes bits
+    CallSent,      // Path, Name: method, Value: serial
+    Reply,         // Name: error, if any, Value: serial of the call,
+                   // Latency: until the reply was collected
+    AgentRequest,  // Path, Name: method
+    Transition     // Row: its device, if any, Name: the new state
+  };
+
+  // Every thread which records has a ring and cursor of its own, so that
+  // they do not contend.
+  enum class Producer : std::uint8_t { Main, IO };
+
+  constexpr std::uint32_t NoRow = UINT32_MAX;
+
+  // Only what is at hand is stored, text is made up when dumping.
+  struct Event {
+    std::int64_t Time;     // steady_clock nanoseconds
+    char const *Path;      // interned object path
+    char const *Name;      // static or interned method, error or state name
+    std::uint32_t Row;     // device table row, or NoRow
+    std::uint32_t Value;
+    std::uint32_t Latency; // microseconds
+    Kind What;
+  };
+
+  class Recorder final {
+  public:
+    // Text for a device table row, asked for when dumping.
+    using Describe = std::function<std::string(std::uint32_t Row)>;
+
+  private:
+    static constexpr std::size_t Capacity = 1024;
+    static constexpr std::size_t CacheLine = 64;
+
+    struct Slot {
+      Event Data;
+      // Index + 1 once Data is complete, 0 while it is written.
+      std::atomic<std::uint64_t> Sequence{0};
+    };
+    // Only its producer writes Next, so it needs no read-modify-write.
+    // Padding keeps it off the cache line of the other producer's slots.
+    struct Ring {
+      char PadNext[CacheLine];
+      std::atomic<std::uint64_t> Next{0};
+      char PadSlots[CacheLine - sizeof(std::atomic<std::uint64_t>)];
+      std::array<Slot, Capacity> Slots;
+    };
+    std::array<Ring, 2> Rings;
+    std::chrono::steady_clock::time_point const Start;
+    Describe const DescribeRow;
+
+    std::mutex InternMutex;
+    std::unordered_set<std::string> Interned;
+
+  public:
+    explicit Recorder(Describe DescribeRow = nullptr)
+    : Start(std::chrono::steady_clock::now())
+    , DescribeRow(std::move(DescribeRow)) {}
+    Recorder(Recorder const &) = delete;
+    Recorder &operator=(Recorder const &) = delete;
+
+    // A copy of Text which lives as long as the recorder, for names and
+    // paths which are not static.  Takes a lock, so it is meant for
+    // events which are rare, and for a limited vocabulary like method and
+    // error names.  Returns nullptr for nullptr or if memory ran out.
+    char const *intern(char const *Text) noexcept;
+
+    void record(Producer Who, Kind What,
+                std::chrono::steady_clock::time_point When,
+                std::uint32_t Row, char const *Path, char const *Name,
+                std::uint32_t Value = 0,
+                std::chrono::steady_clock::duration Latency = {}) noexcept {
+      auto &Ring = Rings[static_cast<std::size_t>(Who)];
+      auto const Index = Ring.Next.load(std::memory_order_relaxed);
+      auto &Slot = Ring.Slots[Index % Capacity];
+
+      Slot.Sequence.store(0, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_release);
+      Slot.Data.Time = std::chrono::duration_cast<std::chrono::nanoseconds>
+        (When.time_since_epoch()).count();
+      Slot.Data.Path = Path;
+      Slot.Data.Name = Name;
+      Slot.Data.Row = Row;
+      Slot.Data.Value = Value;
+      Slot.Data.Latency = std::chrono::duration_cast<std::chrono::microseconds>
+        (Latency).count();
+      Slot.Data.What = What;
+      Slot.Sequence.store(Index + 1, std::memory_order_release);
+      Ring.Next.store(Index + 1, std::memory_order_release);
+    }
+
+    // Events recorded so far, including those which were overwritten.
+    std::uint64_t size() const;
+
+    // Oldest first.  Slots which are being overwritten are skipped.  Rows
+    // are described by whatever device has them when dumping, so call it
+    // from the thread which owns the model.
+    void dump(std::ostream &) const;
+    void dump(char const *Path) const;
+  };
+}
+
+#endif // FLIGHT_HPP
@@ -0,0 +1,368 @@
+#include <chrono>
+#include <csignal>
+#include <iostream>
+
+#include <boost/program_options.hpp>
+
+#include "bluepairy.hxx"
+#include "flight.hxx"
+#include "sdnotify.hxx"
+
+namespace {
+  volatile std::sig_atomic_t Terminate = 0;
+  volatile std::sig_atomic_t DumpRequested = 0;
+
+  char const *describe(Pairing::State State) {
+    switch (State) {
+    case Pairing::State::PoweringUp: return "Powering up adapters";
+    case Pairing::State::Searching: return "Searching for the device";
+    case Pairing::State::Pairing: return "Pairing";
+    case Pairing::State::Resolving: return "Resolving services";
+    case Pairing::State::Trusting: return "Trusting the paired device";
+    case Pairing::State::Connecting: return "Connecting profiles";
+    case Pairing::State::Done: return "Connected";
+    case Pairing::State::Failed: break;
+    }
+
+    return "Failed";
+  }
+
+  // COMPANY[:HEXPAYLOADPREFIX], for instance 0x0a7b:0102.
+  Bluepairy::Hints::Manufacturer parseManufacturer(std::string const &Text) {
+    Bluepairy::Hints::Manufacturer Result;
+    auto const Colon = Text.find(':');
+    std::size_t End;
+
+    auto const Company = std::stoul(Text.substr(0, Colon), &End, 0);
+    if (End != Text.substr(0, Colon).size() || Company > 0xFFFF) {
+      throw std::invalid_argument("Invalid company identifier in " + Text);
+    }
+    Result.Company = Company;
+
+    if (Colon != std::string::npos) {
+      auto const Hex = Text.substr(Colon + 1);
+      if (Hex.size() % 2 != 0 ||
+          Hex.find_first_not_of("0123456789abcdefABCDEF") != std::string::npos) {
+        throw std::invalid_argument("Invalid payload prefix in " + Text);
+      }
+      for (std::size_t I = 0; I < Hex.size(); I += 2) {
+        Result.Prefix.push_back(std::stoul(Hex.substr(I, 2), nullptr, 16));
+      }
+    }
+
+    return Result;
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  std::string FriendlyName;
+  std::string Address;
+  std::string StateSocket;
+  std::string TraceFile;
+  std::string ReadyWhen = "connected";
+  std::string FlightFile;
+  unsigned DumpAfter = 60;
+  unsigned StaleSeconds = 0;
+  std::vector<std::string> UUIDs;
+  std::vector<std::string> Classes, Appearances, Manufacturers;
+  Bluepairy::Hints Hints;
+
+  using command_line_parser = boost::program_options::command_line_parser;
+  using invalid_command_line_syntax = boost::program_options::invalid_command_line_syntax;
+  using options_description = boost::program_options::options_description;
+  using positional_options_description = boost::program_options::positional_options_description;
+  using required_option = boost::program_options::required_option;
+  using minutes = std::chrono::minutes;
+  using seconds = std::chrono::seconds;
+  using unknown_option = boost::program_options::unknown_option;
+  using variables_map = boost::program_options::variables_map;
+
+  options_description Desc("Allowed options");
+  Desc.add_options()
+  ("help,?", "print usage message")
+  ("friendly-name,n", boost::program_options::value(&FriendlyName),
+   "Device name (regex)")
+  ("address,a", boost::program_options::value(&Address),
+   "Device address, instead of the name.  Skips discovery if possible")
+  ("connect,c", boost::program_options::value(&UUIDs), "UUID (regex)")
+  ("class", boost::program_options::value(&Classes),
+   "Match devices without a name yet by their Class of Device")
+  ("appearance", boost::program_options::value(&Appearances),
+   "Match devices without a name yet by their GAP appearance")
+  ("manufacturer", boost::program_options::value(&Manufacturers),
+   "Match devices without a name yet by manufacturer data, "
+   "COMPANY[:HEXPREFIX]")
+  ("advertised", boost::program_options::value(&Hints.UUIDs),
+   "Match devices without a name yet by an advertised service UUID")
+  ("hid", "Connect to Human Interface Device Service")
+  ("pair-first", "Pair as soon as the name matches and check the profiles "
+   "once services are resolved")
+  ("threaded", "Do bus I/O and signal decoding on a dedicated thread")
+  ("state-socket", boost::program_options::value(&StateSocket),
+   "Serve pairing state on this Unix socket and keep running")
+  ("record", boost::program_options::value(&TraceFile),
+   "Record D-Bus traffic to this file for bluepairy-replay")
+  ("forget-stale", boost::program_options::value(&StaleSeconds),
+   "Discover for this many seconds first and remove paired matches which "
+   "were not seen, and after connecting those superseded by the new device")
+  ("flight-recorder", boost::program_options::value(&FlightFile),
+   "Dump recent events to this file on failure, on SIGUSR1 and if pairing "
+   "took longer than --dump-after")
+  ("dump-after", boost::program_options::value(&DumpAfter),
+   "Seconds after which pairing counts as slow (default: 60)")
+  ("ready-when", boost::program_options::value(&ReadyWhen),
+   "Tell systemd the service is ready once the device is \"connected\" "
+   "(default) or already once the adapters and devices are \"loaded\"")
+  ;
+
+  positional_options_description PositionalDesc;
+  PositionalDesc.add("friendly-name", 1);
+  variables_map VariablesMap;
+  try {
+    store(command_line_parser(argc, argv)
+          .options(Desc)
+          .positional(PositionalDesc)
+          .run(), VariablesMap);
+    notify(VariablesMap);
+  } catch (unknown_option &E) {
+    std::cerr << E.what() << std::endl << std::endl << Desc << std::endl;
+    return EXIT_FAILURE;
+  } catch (required_option &E) {
+    std::cerr << E.what() << std::endl << std::endl << Desc << std::endl;
+    return EXIT_FAILURE;
+  } catch (invalid_command_line_syntax &E) {
+    std::cerr << E.what () << std::endl << Desc << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  if (VariablesMap.count("help") > 0) {
+    std::cout << Desc << std::endl;
+    return EXIT_SUCCESS;
+  }
+
+  if (FriendlyName.empty() && Address.empty()) {
+    std::cerr << "Either a friendly name or an address is required."
+              << std::endl << std::endl << Desc << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  if (ReadyWhen != "connected" && ReadyWhen != "loaded") {
+    std::cerr << "--ready-when has to be connected or loaded." << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  try {
+    for (auto const &Class: Classes) {
+      Hints.Classes.push_back(std::stoul(Class, nullptr, 0));
+    }
+    for (auto const &Appearance: Appearances) {
+      Hints.Appearances.push_back(std::stoul(Appearance, nullptr, 0));
+    }
+    for (auto const &Manufacturer: Manufacturers) {
+      Hints.Manufacturers.push_back(parseManufacturer(Manufacturer));
+    }
+  } catch (std::logic_error &E) {
+    std::cerr << "Invalid match hint: " << E.what() << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  for (auto const &UUID: UUIDs) {
+    if (UUID.empty()) {
+      std::cerr << "Empty UUIDs are not allowed." << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (VariablesMap.count("hid") > 0) {
+    UUIDs.push_back("00001124-0000-1000-8000-00805f9b34fb");
+  }
+
+  if (!UUIDs.empty()) {
+    std::cout << "Bluetooth Profile UUIDs required to be offered by "
+              << "the device:" << std::endl;
+    copy(begin(UUIDs), end(UUIDs),
+         std::ostream_iterator<std::string>(std::cout, "\n"));
+  }
+
+  auto const Launched = std::chrono::steady_clock::now();
+  SystemD::Notifier Notify;
+  Notify.status("Loading adapters and devices");
+
+  Bluepairy Bluetooth(FriendlyName, UUIDs);
+  Bluetooth.targetHints(std::move(Hints));
+  Bluetooth.pairFirst(VariablesMap.count("pair-first") > 0);
+
+  if (!Address.empty()) {
+    try {
+      Bluetooth.targetAddress(Address);
+    } catch (std::invalid_argument &E) {
+      std::cerr << E.what() << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (!TraceFile.empty()) {
+    Bluetooth.record(TraceFile);
+  }
+  if (VariablesMap.count("threaded") > 0) {
+    Bluetooth.startIOThread();
+  }
+  if (!StateSocket.empty()) {
+    Bluetooth.serveState(StateSocket);
+  }
+  if (ReadyWhen == "loaded") Notify.ready();
+  auto ReportEventStats = [&Bluetooth] {
+    if (!Bluetooth.isThreaded()) return;
+
+    using microseconds = std::chrono::microseconds;
+    auto Stats = Bluetooth.eventStats();
+    decltype(Stats.TotalLatency) Mean{};
+    if (Stats.Events) Mean = Stats.TotalLatency / Stats.Events;
+    std::clog << "Event queue: " << Stats.Events << " events, max depth "
+              << Stats.MaxQueueDepth << ", " << Stats.Overflows
+              << " overflows, latency mean "
+              << std::chrono::duration_cast<microseconds>(Mean).count()
+              << "us max "
+              << std::chrono::duration_cast<microseconds>(Stats.MaxLatency).count()
+              << "us" << std::endl;
+  };
+
+  auto DumpFlightRecorder = [&Bluetooth, &FlightFile](char const *Reason) {
+    if (FlightFile.empty()) return;
+
+    try {
+      Bluetooth.flightRecorder().dump(FlightFile.c_str());
+      std::clog << "Flight recorder dumped to " << FlightFile
+                << " (" << Reason << ")" << std::endl;
+    } catch (std::exception &E) {
+      std::cerr << E.what() << std::endl;
+    }
+  };
+  if (!FlightFile.empty()) signal(SIGUSR1, [](int) { DumpRequested = 1; });
+
+  // Once per loop iteration.
+  auto Housekeeping = [&Notify, &DumpFlightRecorder] {
+    Notify.keepAlive();
+    if (DumpRequested) {
+      DumpRequested = 0;
+      DumpFlightRecorder("SIGUSR1");
+    }
+  };
+
+  auto ForgetStale = [&Bluetooth](std::chrono::steady_clock::duration Window) {
+    auto Stale = Bluetooth.stalePairings(Window);
+
+    if (Stale.empty()) return;
+
+    for (auto Device: Stale) {
+      std::clog << "Forgetting stale pairing " << Device->name()
+                << " (" << Device->address() << ")" << std::endl;
+    }
+    auto const Removed = Bluetooth.forget(Stale, seconds(5));
+    if (Removed < Stale.size()) {
+      std::cerr << Stale.size() - Removed
+                << " stale pairings could not be removed." << std::endl;
+    }
+  };
+
+  // Devices in range report their RSSI while discovering, so whatever
+  // stays silent for the whole window is gone.
+  if (VariablesMap.count("forget-stale") > 0) {
+    auto const Start = std::chrono::steady_clock::now();
+
+    Notify.status("Looking for stale pairings");
+    Bluetooth.powerUpAllAdapters();
+    Bluetooth.startDiscovery();
+    while (std::chrono::steady_clock::now() < Start + seconds(StaleSeconds)) {
+      Bluetooth.readWrite();
+      Housekeeping();
+    }
+    ForgetStale(std::chrono::steady_clock::now() - Start);
+  }
+
+  Pairing Machine(Bluetooth, minutes(5), &std::clog);
+  Machine.onTransition([&Notify, &Machine](Pairing::State State) {
+    if (State == Pairing::State::Failed) {
+      Notify.status(std::string(describe(State)) + ": " + Machine.error());
+    } else {
+      Notify.status(describe(State));
+    }
+  });
+
+  for (Machine.advance(); !Machine.finished(); Machine.advance()) {
+    Bluetooth.readWrite();
+    Housekeeping();
+  }
+
+  ReportEventStats();
+
+  for (auto const &Entry: Machine.attempts()) {
+    using milliseconds = std::chrono::milliseconds;
+    auto const &Attempt = Entry.second;
+    std::clog << "Pairing attempts for " << Entry.first << ": "
+              << Attempt.Count << ", " << Attempt.Failures
+              << " failed, latency mean "
+              << std::chrono::duration_cast<milliseconds>
+                 (Attempt.TotalLatency / Attempt.Count).count()
+              << "ms max "
+              << std::chrono::duration_cast<milliseconds>(Attempt.MaxLatency).count()
+              << "ms";
+    if (!Attempt.LastError.empty()) {
+      std::clog << ", last error: " << Attempt.LastError;
+    }
+    std::clog << std::endl;
+  }
+  if (Machine.timeSaved() > Machine.timeSaved().zero()) {
+    std::clog << "Pairing first saved at least "
+              << std::chrono::duration_cast<std::chrono::milliseconds>
+                 (Machine.timeSaved()).count()
+              << "ms" << std::endl;
+  }
+
+  if (Machine.state() == Pairing::State::Failed) {
+    std::cerr << Machine.error() << std::endl;
+    DumpFlightRecorder("pairing failed");
+
+    return EXIT_FAILURE;
+  }
+
+  if (std::chrono::steady_clock::now() - Launched > seconds(DumpAfter)) {
+    DumpFlightRecorder("pairing was slow");
+  }
+
+  auto UsableDevices = Bluetooth.usableDevices();
+
+  if (!UsableDevices.empty()) {
+    std::cout << "Found "
+              << (UsableDevices.size() == 1? "one matching device"
+                  : "several usable matches")
+              << ":" << std::endl;
+    for (auto Device: UsableDevices) {
+      std::cout << Device->name() << " (" << Device->address()
+                << ") paired via " << Device->adapter()->address()
+                << std::endl;
+    }
+
+    if (ReadyWhen == "connected") Notify.ready();
+
+    if (VariablesMap.count("forget-stale") > 0) {
+      ForgetStale(seconds(StaleSeconds));
+    }
+
+    if (!StateSocket.empty()) {
+      Notify.status("Connected, serving pairing state");
+      signal(SIGINT, [](int) { Terminate = 1; });
+      signal(SIGTERM, [](int) { Terminate = 1; });
+      while (!Terminate) {
+        Bluetooth.readWrite();
+        Housekeeping();
+      }
+      Notify.stopping();
+    }
+
+    return EXIT_SUCCESS;
+  }
+
+  return EXIT_FAILURE;
+}
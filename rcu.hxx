@@ -0,0 +1,130 @@
+#if !defined(RCU_HPP)
+#define RCU_HPP
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Read-copy-update of an immutable T.  One thread publishes new versions,
+// any thread reads the current one without taking locks.  Readers announce
+// the epoch they started in, and a replaced version is only deleted once
+// every reader which might still see it is gone.
+template<typename T, std::size_t MaxReaders = 64>
+class RCU final {
+  // Every reader on a cache line of its own.  Padding rather than alignas,
+  // like in RingBuffer, so that whatever contains an RCU is not
+  // over-aligned and can still be created with new before C++17.
+  static constexpr std::size_t CacheLine = 64;
+
+  struct Slot {
+    // Epoch the reader started in, 0 while the slot is free.
+    std::atomic<std::uint64_t> Epoch{0};
+    char Pad[CacheLine - sizeof(std::atomic<std::uint64_t>)];
+  };
+
+  std::atomic<T const *> Current{nullptr};
+  std::atomic<std::uint64_t> Epoch{1};
+  char PadEpoch[CacheLine];
+  std::array<Slot, MaxReaders> Slots;
+  // Replaced versions and the epoch they were replaced in.  Writer only.
+  std::vector<std::pair<T const *, std::uint64_t>> Retired;
+
+public:
+  class Reader final {
+    Slot *Entry = nullptr;
+    T const *Value = nullptr;
+
+    Reader(Slot *Entry, T const *Value) : Entry(Entry), Value(Value) {}
+    friend class RCU;
+
+  public:
+    Reader() = default;
+    Reader(Reader &&Other) noexcept : Entry(Other.Entry), Value(Other.Value) {
+      Other.Entry = nullptr;
+      Other.Value = nullptr;
+    }
+    Reader &operator=(Reader &&Other) noexcept {
+      std::swap(Entry, Other.Entry);
+      std::swap(Value, Other.Value);
+      return *this;
+    }
+    Reader(Reader const &) = delete;
+    Reader &operator=(Reader const &) = delete;
+    ~Reader() { release(); }
+
+    void release() noexcept {
+      if (Entry) Entry->Epoch.store(0, std::memory_order_release);
+      Entry = nullptr;
+      Value = nullptr;
+    }
+
+    // False if nothing was published yet.
+    explicit operator bool() const { return Value != nullptr; }
+    T const &operator*() const { return *Value; }
+    T const *operator->() const { return Value; }
+  };
+
+  RCU() = default;
+  RCU(RCU const &) = delete;
+  RCU &operator=(RCU const &) = delete;
+  // No reader may be left.
+  ~RCU() {
+    delete Current.load(std::memory_order_relaxed);
+    for (auto const &Version: Retired) delete Version.first;
+  }
+
+  // Any thread.  Only waits if MaxReaders are reading at the same time.
+  Reader read() {
+    for (;;) {
+      for (auto &Slot: Slots) {
+        std::uint64_t Free = 0;
+        // Announcing an epoch which has already passed only delays
+        // reclamation.
+        if (Slot.Epoch.compare_exchange_strong(Free, Epoch.load())) {
+          return Reader(&Slot, Current.load());
+        }
+      }
+      std::this_thread::yield();
+    }
+  }
+
+  // Publishing thread only.
+  void publish(std::unique_ptr<T const> Value) {
+    if (auto Old = Current.exchange(Value.release())) {
+      Retired.emplace_back(Old, Epoch.fetch_add(1));
+    }
+    reclaim();
+  }
+
+  // Publishing thread only.  Deletes the versions which no reader can see
+  // anymore.  A reader which started in epoch E may still see versions
+  // replaced in E or later.
+  void reclaim() {
+    auto Oldest = std::numeric_limits<std::uint64_t>::max();
+    for (auto const &Slot: Slots) {
+      auto const Started = Slot.Epoch.load();
+      if (Started != 0 && Started < Oldest) Oldest = Started;
+    }
+
+    auto Kept = Retired.begin();
+    for (auto const &Version: Retired) {
+      if (Version.second < Oldest) {
+        delete Version.first;
+      } else {
+        *Kept++ = Version;
+      }
+    }
+    Retired.erase(Kept, Retired.end());
+  }
+
+  // Replaced versions which are not deleted yet.
+  std::size_t retired() const { return Retired.size(); }
+};
+
+#endif // RCU_HPP
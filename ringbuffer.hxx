@@ -0,0 +1,57 @@
+#if !defined(RINGBUFFER_HPP)
+#define RINGBUFFER_HPP
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <utility>
+
+// Bounded single-producer/single-consumer queue.  push() must only ever be
+// called from one thread and pop() from one (other) thread.
+template<typename T, std::size_t Capacity>
+class RingBuffer final {
+  static_assert(Capacity >= 2 && (Capacity & (Capacity - 1)) == 0,
+                "Capacity must be a power of two");
+
+  // Head and Tail on cache lines of their own.  Padding rather than
+  // alignas, so that whatever contains a RingBuffer is not over-aligned
+  // and can still be created with new before C++17.
+  static constexpr std::size_t CacheLine = 64;
+
+  std::array<T, Capacity> Slots;
+  char PadSlots[CacheLine];
+  std::atomic<std::size_t> Head{0};
+  char PadHead[CacheLine - sizeof(std::atomic<std::size_t>)];
+  std::atomic<std::size_t> Tail{0};
+  char PadTail[CacheLine - sizeof(std::atomic<std::size_t>)];
+
+public:
+  bool push(T &&Value) {
+    auto const T0 = Tail.load(std::memory_order_relaxed);
+    if (T0 - Head.load(std::memory_order_acquire) == Capacity) return false;
+
+    Slots[T0 & (Capacity - 1)] = std::move(Value);
+    Tail.store(T0 + 1, std::memory_order_release);
+
+    return true;
+  }
+
+  bool pop(T &Value) {
+    auto const H0 = Head.load(std::memory_order_relaxed);
+    if (H0 == Tail.load(std::memory_order_acquire)) return false;
+
+    Value = std::move(Slots[H0 & (Capacity - 1)]);
+    Head.store(H0 + 1, std::memory_order_release);
+
+    return true;
+  }
+
+  std::size_t size() const {
+    return Tail.load(std::memory_order_acquire) -
+           Head.load(std::memory_order_acquire);
+  }
+  bool empty() const { return size() == 0; }
+  static constexpr std::size_t capacity() { return Capacity; }
+};
+
+#endif // RINGBUFFER_HPP
@@ -0,0 +1,80 @@
+#if !defined(SDNOTIFY_HPP)
+#define SDNOTIFY_HPP
+
+#include <chrono>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// The sd_notify(3) protocol without libsystemd: state changes are sent as
+// datagrams to $NOTIFY_SOCKET.  Does nothing if the variable is not set,
+// and notification failures are ignored just like sd_notify() does.
+namespace SystemD {
+  class Notifier final {
+    int FD = -1;
+    sockaddr_un Address;
+    socklen_t AddressLength = 0;
+    std::chrono::steady_clock::duration WatchdogInterval{};
+    std::chrono::steady_clock::time_point LastPing;
+
+  public:
+    Notifier() {
+      auto const Socket = getenv("NOTIFY_SOCKET");
+      if (Socket == nullptr || (Socket[0] != '/' && Socket[0] != '@')) return;
+
+      auto const Length = strlen(Socket);
+      if (Length >= sizeof(Address.sun_path)) return;
+
+      memset(&Address, 0, sizeof(Address));
+      Address.sun_family = AF_UNIX;
+      memcpy(Address.sun_path, Socket, Length);
+      // Abstract namespace.
+      if (Address.sun_path[0] == '@') Address.sun_path[0] = '\0';
+      AddressLength = offsetof(sockaddr_un, sun_path) + Length;
+
+      FD = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+
+      auto const Pid = getenv("WATCHDOG_PID");
+      auto const Usec = getenv("WATCHDOG_USEC");
+      if (Usec && (Pid == nullptr || atol(Pid) == getpid())) {
+        WatchdogInterval = std::chrono::microseconds(strtoull(Usec, nullptr, 10));
+        LastPing = std::chrono::steady_clock::now();
+      }
+    }
+    Notifier(Notifier const &) = delete;
+    Notifier &operator=(Notifier const &) = delete;
+    ~Notifier() { if (FD != -1) close(FD); }
+
+    explicit operator bool() const { return FD != -1; }
+
+    void send(std::string const &State) const {
+      if (FD == -1) return;
+
+      sendto(FD, State.data(), State.size(), MSG_NOSIGNAL,
+             reinterpret_cast<sockaddr const *>(&Address), AddressLength);
+    }
+
+    void ready() const { send("READY=1"); }
+    void status(std::string const &Text) const { send("STATUS=" + Text); }
+    void stopping() const { send("STOPPING=1"); }
+
+    // Call regularly from every loop.  Pings the watchdog whenever half of
+    // WATCHDOG_USEC has passed since the last ping.
+    void keepAlive() {
+      if (WatchdogInterval == WatchdogInterval.zero()) return;
+
+      auto const Now = std::chrono::steady_clock::now();
+      if (Now - LastPing >= WatchdogInterval / 2) {
+        send("WATCHDOG=1");
+        LastPing = Now;
+      }
+    }
+  };
+}
+
+#endif // SDNOTIFY_HPP
@@ -0,0 +1,92 @@
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+
+#include "trace.hxx"
+
+namespace {
+  char const Magic[8] = { 'B', 'P', 'T', 'R', 'A', 'C', 'E', '1' };
+}
+
+Trace::Writer::Writer(std::string const &Path)
+: Out(Path, std::ios::binary | std::ios::trunc)
+, Start(std::chrono::steady_clock::now())
+{
+  if (!Out.write(Magic, sizeof(Magic))) {
+    throw std::runtime_error("Failed to create trace " + Path);
+  }
+}
+
+void Trace::Writer::write(Direction What, DBusMessage *Message)
+{
+  auto const Time = std::chrono::duration_cast<std::chrono::nanoseconds>
+    (std::chrono::steady_clock::now() - Start).count();
+  char *Data;
+  int Length;
+
+  if (dbus_message_marshal(Message, &Data, &Length) == FALSE) {
+    throw std::bad_alloc();
+  }
+
+  std::uint64_t const Nanoseconds = Time;
+  std::uint32_t const Size = Length;
+  char const Tag = static_cast<char>(What);
+  {
+    std::lock_guard<std::mutex> Lock(Mutex);
+
+    Out.write(reinterpret_cast<char const *>(&Nanoseconds), sizeof(Nanoseconds));
+    Out.write(&Tag, sizeof(Tag));
+    Out.write(reinterpret_cast<char const *>(&Size), sizeof(Size));
+    Out.write(Data, Length);
+    Out.flush();
+  }
+  dbus_free(Data);
+}
+
+Trace::Reader::Reader(std::string const &Path)
+: In(Path, std::ios::binary)
+{
+  char Header[sizeof(Magic)];
+
+  if (!In.read(Header, sizeof(Header)) ||
+      memcmp(Header, Magic, sizeof(Magic)) != 0) {
+    throw std::runtime_error(Path + " is not a bluepairy trace");
+  }
+}
+
+bool Trace::Reader::next(Record &Result)
+{
+  std::uint64_t Nanoseconds;
+  std::uint32_t Size;
+  char Tag;
+
+  if (!In.read(reinterpret_cast<char *>(&Nanoseconds), sizeof(Nanoseconds))) {
+    return false;
+  }
+  if (!In.read(&Tag, sizeof(Tag)) ||
+      !In.read(reinterpret_cast<char *>(&Size), sizeof(Size))) {
+    throw std::runtime_error("Truncated trace record");
+  }
+  Buffer.resize(Size);
+  if (!In.read(&Buffer[0], Size)) {
+    throw std::runtime_error("Truncated trace record");
+  }
+
+  DBusError Error;
+  dbus_error_init(&Error);
+  auto Message = dbus_message_demarshal(Buffer.data(), Size, &Error);
+  if (Message == nullptr) {
+    std::runtime_error E(std::string("Malformed message in trace: ") +
+                         (dbus_error_is_set(&Error)? Error.message : ""));
+    dbus_error_free(&Error);
+    throw E;
+  }
+
+  if (Result.Message) dbus_message_unref(Result.Message);
+  Result.Time = std::chrono::nanoseconds(Nanoseconds);
+  Result.What = static_cast<Direction>(Tag);
+  Result.Size = Size;
+  Result.Message = Message;
+
+  return true;
+}
@@ -0,0 +1,59 @@
+#if !defined(TRACE_HPP)
+#define TRACE_HPP
+
+#include <chrono>
+#include <cstddef>
+#include <fstream>
+#include <mutex>
+#include <string>
+
+#include <dbus/dbus.h>
+
+// Recorded D-Bus traffic.  A trace starts with the magic "BPTRACE1",
+// followed by records of
+//   uint64 nanoseconds since recording started
+//   uint8  direction ('<' received, '>' sent)
+//   uint32 length of the message
+//   the message in D-Bus wire format, see dbus_message_marshal().
+// Integers are in host byte order; traces are meant to be replayed on the
+// architecture they were recorded on.
+namespace Trace {
+  enum class Direction : char { Received = '<', Sent = '>' };
+
+  class Writer final {
+    std::ofstream Out;
+    std::chrono::steady_clock::time_point const Start;
+    std::mutex Mutex;
+
+  public:
+    explicit Writer(std::string const &Path);
+
+    // May be called from the I/O thread and the main thread alike.
+    void write(Direction, DBusMessage *);
+  };
+
+  struct Record {
+    std::chrono::nanoseconds Time;
+    Direction What;
+    std::size_t Size;
+    DBusMessage *Message = nullptr;
+
+    Record() = default;
+    Record(Record const &) = delete;
+    Record &operator=(Record const &) = delete;
+    ~Record() { if (Message) dbus_message_unref(Message); }
+  };
+
+  class Reader final {
+    std::ifstream In;
+    std::string Buffer;
+
+  public:
+    explicit Reader(std::string const &Path);
+
+    // Returns false at the end of the trace.
+    bool next(Record &);
+  };
+}
+
+#endif // TRACE_HPP